@@ -0,0 +1,102 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Include in the one source file of a program to count every heap allocation
+// it makes, so we can see how many allocations a loop makes or check that it
+// has reached a steady state with none. Every form of operator new and
+// operator delete is replaced, so whatever the library or a sanitizer would
+// pair up, it is our malloc and our free.
+std::atomic<std::size_t> alloc_count{0};
+
+namespace alloc_count_detail {
+
+inline void *allocate(std::size_t n, std::size_t align) noexcept {
+  alloc_count.fetch_add(1, std::memory_order_relaxed);
+  n = n ? n : 1;
+  if (align <= alignof(std::max_align_t)) {
+    return std::malloc(n);
+  }
+  // aligned_alloc wants a multiple of the alignment
+  return std::aligned_alloc(align, (n + align - 1) / align * align);
+}
+
+inline void *allocate_or_throw(std::size_t n, std::size_t align) {
+  if (void *p = allocate(n, align)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// Kept out of line: inlined into a caller, the free would be paired with the
+// operator new the caller called, and GCC would warn about the mismatch.
+[[gnu::noinline]] inline void deallocate(void *p) noexcept { std::free(p); }
+
+} // namespace alloc_count_detail
+
+void *operator new(std::size_t n) {
+  return alloc_count_detail::allocate_or_throw(n, 0);
+}
+void *operator new[](std::size_t n) {
+  return alloc_count_detail::allocate_or_throw(n, 0);
+}
+void *operator new(std::size_t n, std::align_val_t a) {
+  return alloc_count_detail::allocate_or_throw(n, std::size_t(a));
+}
+void *operator new[](std::size_t n, std::align_val_t a) {
+  return alloc_count_detail::allocate_or_throw(n, std::size_t(a));
+}
+void *operator new(std::size_t n, const std::nothrow_t &) noexcept {
+  return alloc_count_detail::allocate(n, 0);
+}
+void *operator new[](std::size_t n, const std::nothrow_t &) noexcept {
+  return alloc_count_detail::allocate(n, 0);
+}
+void *operator new(std::size_t n, std::align_val_t a,
+                   const std::nothrow_t &) noexcept {
+  return alloc_count_detail::allocate(n, std::size_t(a));
+}
+void *operator new[](std::size_t n, std::align_val_t a,
+                     const std::nothrow_t &) noexcept {
+  return alloc_count_detail::allocate(n, std::size_t(a));
+}
+
+void operator delete(void *p) noexcept { alloc_count_detail::deallocate(p); }
+void operator delete[](void *p) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete(void *p, std::size_t) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete[](void *p, std::size_t) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete(void *p, std::align_val_t) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete[](void *p, std::align_val_t) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete(void *p, std::size_t, std::align_val_t) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete[](void *p, std::size_t, std::align_val_t) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete(void *p, std::align_val_t,
+                     const std::nothrow_t &) noexcept {
+  alloc_count_detail::deallocate(p);
+}
+void operator delete[](void *p, std::align_val_t,
+                       const std::nothrow_t &) noexcept {
+  alloc_count_detail::deallocate(p);
+}
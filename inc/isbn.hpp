@@ -0,0 +1,162 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// An ISBN, validated and reduced to the 13-digit number of its ISBN-13.
+// Parsing accepts an ISBN-10 or ISBN-13, with or without single hyphens
+// between the digits (a lowercase x is read as X), and checks the check
+// digit. An ISBN-10 becomes the ISBN-13 of the same book: 978, its first
+// nine digits, and a new check digit. Only that number is stored, so every
+// way of writing one book gives the same key, and comparing or hashing two
+// ISBNs is one integer operation. A default Isbn is empty, with key 0,
+// which is less than every real one.
+class Isbn {
+public:
+  Isbn() = default;
+  explicit Isbn(std::string_view s) {
+    if (!parse(s, *this)) {
+      throw std::invalid_argument("not an ISBN: " + std::string(s));
+    }
+  }
+
+  // false, leaving `out` alone, if s is not a valid ISBN-10 or ISBN-13
+  static bool parse(std::string_view s, Isbn &out) noexcept;
+  // the same for a key, as stored by key()
+  static bool from_key(std::uint64_t k, Isbn &out) noexcept;
+
+  std::uint64_t key() const { return k; }
+  // writes the 13 digits without hyphens to buf, or nothing if empty, and
+  // returns the end; buf must have room for 13
+  char *write(char *buf) const noexcept;
+  // the same as a string, short enough for the small-string buffer
+  std::string str() const;
+  bool empty() const { return !k; }
+
+private:
+  std::uint64_t k = 0;
+
+  // the ISBN-13 check digit for the first twelve digits
+  static unsigned check_digit(std::uint64_t first12) noexcept {
+    unsigned sum = 0;
+    for (unsigned i = 0; i != 12; ++i, first12 /= 10) {
+      sum += first12 % 10 * (i % 2 ? 1 : 3); // 1 3 1 3 ... from the left
+    }
+    return (10 - sum % 10) % 10;
+  }
+};
+
+inline bool Isbn::parse(std::string_view s, Isbn &out) noexcept {
+  // 13 digits with a hyphen between every two is as long as an ISBN gets
+  if (s.empty() || s.size() > 25 || s.front() == '-' || s.back() == '-') {
+    return false;
+  }
+  // Both check digits are taken from sums kept while parsing, which is
+  // cheaper than a second pass: the digits at even and at odd positions,
+  // and each digit times its position.
+  std::uint64_t n = 0;
+  unsigned digits = 0, even = 0, odd = 0, weighted = 0, last = 0;
+  for (std::size_t i = 0; i != s.size(); ++i) {
+    unsigned v = static_cast<unsigned char>(s[i]) - '0';
+    if (v > 9) {
+      if (s[i] == '-' && s[i - 1] != '-') {
+        continue;
+      }
+      if ((s[i] != 'X' && s[i] != 'x') || digits != 9 || i + 1 != s.size()) {
+        return false;
+      }
+      v = 10; // only as the check digit of an ISBN-10
+    }
+    n = n * 10 + v;
+    (digits % 2 ? odd : even) += v;
+    weighted += digits * v;
+    last = v;
+    ++digits;
+  }
+  if (digits == 10) {
+    // the ISBN-10 check weighs the digits 10 down to 1
+    if ((10 * (even + odd) - weighted) % 11) {
+      return false;
+    }
+    // the ISBN-13 of the first nine after 978, weighed 3 1 3 ... 3
+    unsigned sum = 9 + 7 * 3 + 8 + 3 * even + odd - last;
+    n = (978000000000ull + (n - last) / 10) * 10 + (10 - sum % 10) % 10;
+  } else if (digits == 13) {
+    auto prefix = n / 10000000000ull;
+    if ((prefix != 978 && prefix != 979) || (even + 3 * odd) % 10) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+  out.k = n;
+  return true;
+}
+
+inline bool Isbn::from_key(std::uint64_t k, Isbn &out) noexcept {
+  if (k < 9780000000000ull || k >= 9800000000000ull ||
+      k % 10 != check_digit(k / 10)) {
+    return false;
+  }
+  out.k = k;
+  return true;
+}
+
+inline char *Isbn::write(char *buf) const noexcept {
+  if (!k) {
+    return buf;
+  }
+  auto n = k;
+  for (std::size_t i = 13; i-- != 0; n /= 10) {
+    buf[i] = '0' + n % 10;
+  }
+  return buf + 13;
+}
+
+inline std::string Isbn::str() const {
+  char buf[13];
+  return std::string(buf, write(buf));
+}
+
+inline bool operator==(const Isbn &lhs, const Isbn &rhs) {
+  return lhs.key() == rhs.key();
+}
+inline bool operator!=(const Isbn &lhs, const Isbn &rhs) {
+  return lhs.key() != rhs.key();
+}
+inline bool operator<(const Isbn &lhs, const Isbn &rhs) {
+  return lhs.key() < rhs.key();
+}
+inline bool operator>(const Isbn &lhs, const Isbn &rhs) {
+  return lhs.key() > rhs.key();
+}
+inline bool operator<=(const Isbn &lhs, const Isbn &rhs) {
+  return lhs.key() <= rhs.key();
+}
+inline bool operator>=(const Isbn &lhs, const Isbn &rhs) {
+  return lhs.key() >= rhs.key();
+}
+
+// formats in place rather than through str()
+inline std::ostream &operator<<(std::ostream &os, const Isbn &isbn) {
+  char buf[13];
+  return os << std::string_view(buf, isbn.write(buf) - buf);
+}
+
+namespace std {
+
+// consecutive ISBNs differ in the low digits, which are mixed into the
+// high bits
+template <> struct hash<Isbn> {
+  size_t operator()(const Isbn &isbn) const noexcept {
+    std::uint64_t h = isbn.key() * 0x9e3779b97f4a7c15ull;
+    return h ^ h >> 32;
+  }
+};
+
+} // namespace std
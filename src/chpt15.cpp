@@ -8,6 +8,8 @@
 #include <string>
 #include <vector>
 
+#include "isbn.hpp"
+
 /*----------------------------------------------------------------------------*/
 
 class Quote {
@@ -19,10 +21,14 @@ public:
   Quote &operator=(Quote &&) = default;      // move assignment
   virtual ~Quote() = default;
 
+  // throws std::invalid_argument if book is not an ISBN
   Quote(const std::string &book, double sales_price)
-      : bookNo(book), price(sales_price) {}
+      : bookNo(book), key(book), price(sales_price) {}
 
-  std::string isbn() const { return bookNo; }
+  // the ISBN as it was given, which is how the book prints
+  const std::string &isbn() const { return bookNo; }
+  // the canonical ISBN-13, for comparing
+  const Isbn &isbn_key() const { return key; }
   virtual double net_price(std::size_t n) const { return n * price; }
   virtual void debug() const {
     std::cout << bookNo << " " << price; // minimal formatting
@@ -34,6 +40,7 @@ public:
 
 private:
   std::string bookNo;
+  Isbn key;
 
 protected:
   double price = 0.0;
@@ -131,7 +138,7 @@ private:
   // predicate required by multiset; strict weak ordering
   static bool compare(const std::shared_ptr<Quote> &lhs,
                       const std::shared_ptr<Quote> &rhs) {
-    return lhs->isbn() < rhs->isbn();
+    return lhs->isbn_key() < rhs->isbn_key();
   }
   // a multiset to hold multiple quotes, ordered by `compare`
   std::multiset<std::shared_ptr<Quote>, decltype(compare) *> items{compare};
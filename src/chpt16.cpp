@@ -2,6 +2,9 @@
 //  Chapter 16 - Templates and Generic Programming
 //
 
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iostream>
@@ -13,6 +16,10 @@
 #include <utility>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /* -------------------------------------------------------------------------- */
 
 // uses references to const as parameters
@@ -679,9 +686,21 @@ template <> struct hash<Sales_data> {
   size_t operator()(const Sales_data &s) const;
 };
 
+// XOR-ing the member hashes cancels equal values and leaves the identity
+// hashes of unsigned and double nearly unmixed, so the members are folded
+// in with wyhash's multiply-and-fold step instead
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+  auto r = static_cast<unsigned __int128>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
 size_t hash<Sales_data>::operator()(const Sales_data &s) const {
-  return hash<string>()(s.bookNo) ^ hash<unsigned>()(s.units_sold) ^
-         hash<double>()(s.revenue);
+  double rev = s.revenue == 0 ? 0 : s.revenue; // -0.0 == 0.0
+  uint64_t bits;
+  memcpy(&bits, &rev, sizeof(bits));
+  uint64_t h = hash<string>()(s.bookNo);
+  h = wymix(h ^ 0xa0761d6478bd642full, s.units_sold ^ 0xe7037ed1a0b428dbull);
+  return wymix(h ^ bits ^ 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull);
 }
 
 } // namespace std
@@ -700,6 +719,242 @@ template <> void Foo_<int>::Bar() {}
 
 /* -------------------------------------------------------------------------- */
 
+/* ------------------------ Open-Addressing Hash Set ------------------------ */
+
+// A SwissTable-style hash set. Slots come in groups of 16, and each slot has
+// a control byte: empty, deleted, or the low 7 bits of its element's hash.
+// A lookup compares all 16 control bytes of a group at once (with SSE2
+// where available), and only looks at the elements whose bytes match, so
+// most probes never touch an element. With Multi set, equal elements are
+// all kept, as in unordered_multiset.
+template <typename T, bool Multi = false, typename Hash = std::hash<T>,
+          typename Eq = std::equal_to<T>>
+class flat_hash_set {
+public:
+  class const_iterator;
+
+  flat_hash_set() = default;
+  flat_hash_set(const flat_hash_set &) = delete;
+  flat_hash_set &operator=(const flat_hash_set &) = delete;
+  ~flat_hash_set() { free(); }
+
+  size_t size() const { return count_; }
+  bool empty() const { return !count_; }
+
+  bool insert(const T &t) { return emplace(t); }
+  bool insert(T &&t) { return emplace(std::move(t)); }
+  size_t count(const T &) const;
+  bool contains(const T &t) const { return find(t) != npos; }
+  size_t erase(const T &); // removes every element equal to t
+
+  const_iterator begin() const { return const_iterator(this, next_full(0)); }
+  const_iterator end() const { return const_iterator(this, capacity()); }
+
+private:
+  static constexpr size_t group_size = 16;
+  static constexpr int8_t empty_slot = -128; // 0b10000000
+  static constexpr int8_t deleted = -2;      // 0b11111110
+  static constexpr size_t npos = -1;
+
+  inline static std::allocator<T> alloc;
+  int8_t *ctrl = nullptr;
+  T *slots = nullptr;
+  size_t groups = 0;
+  size_t count_ = 0;
+  size_t used = 0; // full and deleted slots; empty ones end a probe
+
+  size_t capacity() const { return groups * group_size; }
+
+  // bit i is set if control byte i of group g equals b
+  uint32_t match(size_t g, int8_t b) const {
+    const int8_t *c = ctrl + g * group_size;
+#ifdef __SSE2__
+    auto bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(c));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(b)));
+#else
+    uint32_t mask = 0;
+    for (size_t i = 0; i != group_size; ++i) {
+      mask |= uint32_t(c[i] == b) << i;
+    }
+    return mask;
+#endif
+  }
+
+  size_t next_full(size_t i) const {
+    while (i != capacity() && ctrl[i] < 0) {
+      ++i;
+    }
+    return i;
+  }
+
+  // visits the groups of hash h in probe order until f returns true
+  template <typename F> void probe(size_t h, F f) const {
+    size_t mask = groups - 1, g = (h >> 7) & mask;
+    for (size_t step = 1; !f(g); ++step) {
+      g = (g + step) & mask; // triangular steps reach every group
+    }
+  }
+
+  size_t find(const T &) const;
+  template <typename U> bool emplace(U &&);
+  void rehash(size_t new_groups);
+  void free();
+};
+
+template <typename T, bool Multi, typename Hash, typename Eq>
+class flat_hash_set<T, Multi, Hash, Eq>::const_iterator {
+public:
+  const T &operator*() const { return set->slots[i]; }
+  const T *operator->() const { return &set->slots[i]; }
+  const_iterator &operator++() {
+    i = set->next_full(i + 1);
+    return *this;
+  }
+  bool operator==(const const_iterator &rhs) const { return i == rhs.i; }
+  bool operator!=(const const_iterator &rhs) const { return i != rhs.i; }
+
+private:
+  friend class flat_hash_set;
+  const_iterator(const flat_hash_set *s, size_t n) : set(s), i(n) {}
+  const flat_hash_set *set;
+  size_t i;
+};
+
+template <typename T, bool Multi, typename Hash, typename Eq>
+size_t flat_hash_set<T, Multi, Hash, Eq>::find(const T &t) const {
+  if (!groups) {
+    return npos;
+  }
+  size_t h = Hash()(t), ret = npos;
+  probe(h, [&](size_t g) {
+    for (auto m = match(g, h & 0x7F); m; m &= m - 1) {
+      size_t i = g * group_size + __builtin_ctz(m);
+      if (Eq()(slots[i], t)) {
+        ret = i;
+        return true;
+      }
+    }
+    return match(g, empty_slot) != 0;
+  });
+  return ret;
+}
+
+template <typename T, bool Multi, typename Hash, typename Eq>
+size_t flat_hash_set<T, Multi, Hash, Eq>::count(const T &t) const {
+  if (!groups) {
+    return 0;
+  }
+  size_t h = Hash()(t), n = 0;
+  probe(h, [&](size_t g) {
+    for (auto m = match(g, h & 0x7F); m; m &= m - 1) {
+      n += Eq()(slots[g * group_size + __builtin_ctz(m)], t);
+    }
+    return match(g, empty_slot) != 0 || (!Multi && n);
+  });
+  return n;
+}
+
+template <typename T, bool Multi, typename Hash, typename Eq>
+size_t flat_hash_set<T, Multi, Hash, Eq>::erase(const T &t) {
+  if (!groups) {
+    return 0;
+  }
+  size_t h = Hash()(t), n = 0;
+  probe(h, [&](size_t g) {
+    for (auto m = match(g, h & 0x7F); m; m &= m - 1) {
+      size_t i = g * group_size + __builtin_ctz(m);
+      if (Eq()(slots[i], t)) {
+        std::allocator_traits<std::allocator<T>>::destroy(alloc, slots + i);
+        ctrl[i] = deleted; // keeps later elements of the probe reachable
+        ++n;
+      }
+    }
+    return match(g, empty_slot) != 0 || (!Multi && n);
+  });
+  count_ -= n;
+  return n;
+}
+
+template <typename T, bool Multi, typename Hash, typename Eq>
+template <typename U>
+bool flat_hash_set<T, Multi, Hash, Eq>::emplace(U &&t) {
+  if (!Multi && find(t) != npos) {
+    return false;
+  }
+  if ((used + 1) * 8 > capacity() * 7) { // keep the load under 7/8
+    rehash(count_ * 2 >= capacity() ? std::max<size_t>(1, groups * 2)
+                                     : std::max<size_t>(1, groups));
+  }
+  size_t h = Hash()(t);
+  probe(h, [&](size_t g) {
+    auto m = match(g, empty_slot) | match(g, deleted);
+    if (!m) {
+      return false;
+    }
+    size_t i = g * group_size + __builtin_ctz(m);
+    used += ctrl[i] == empty_slot;
+    ctrl[i] = h & 0x7F;
+    std::allocator_traits<std::allocator<T>>::construct(alloc, slots + i,
+                                                        std::forward<U>(t));
+    return true;
+  });
+  ++count_;
+  return true;
+}
+
+// moves every element into a table of new_groups groups, dropping tombstones
+template <typename T, bool Multi, typename Hash, typename Eq>
+void flat_hash_set<T, Multi, Hash, Eq>::rehash(size_t new_groups) {
+  auto old_ctrl = ctrl;
+  auto old_slots = slots;
+  auto old_cap = capacity();
+  groups = new_groups;
+  ctrl = new int8_t[capacity()];
+  std::fill(ctrl, ctrl + capacity(), empty_slot);
+  slots = alloc.allocate(capacity());
+  used = count_;
+  for (size_t i = 0; i != old_cap; ++i) {
+    if (old_ctrl[i] >= 0) {
+      size_t h = Hash()(old_slots[i]);
+      probe(h, [&](size_t g) {
+        auto m = match(g, empty_slot);
+        if (!m) {
+          return false;
+        }
+        size_t j = g * group_size + __builtin_ctz(m);
+        ctrl[j] = h & 0x7F;
+        std::allocator_traits<std::allocator<T>>::construct(
+            alloc, slots + j, std::move(old_slots[i]));
+        return true;
+      });
+      std::allocator_traits<std::allocator<T>>::destroy(alloc, old_slots + i);
+    }
+  }
+  if (old_cap) {
+    alloc.deallocate(old_slots, old_cap);
+  }
+  delete[] old_ctrl;
+}
+
+template <typename T, bool Multi, typename Hash, typename Eq>
+void flat_hash_set<T, Multi, Hash, Eq>::free() {
+  for (size_t i = 0; i != capacity(); ++i) {
+    if (ctrl[i] >= 0) {
+      std::allocator_traits<std::allocator<T>>::destroy(alloc, slots + i);
+    }
+  }
+  if (slots) {
+    alloc.deallocate(slots, capacity());
+  }
+  delete[] ctrl;
+}
+
+template <typename T, typename Hash = std::hash<T>,
+          typename Eq = std::equal_to<T>>
+using flat_hash_multiset = flat_hash_set<T, true, Hash, Eq>;
+
+/* -------------------------------------------------------------------------- */
+
 int main() {
   {
     std::cout << compare(1, 0) << std::endl;
@@ -982,6 +1237,46 @@ int main() {
     }
   }
 
+  {
+    // the open-addressing set against unordered_multiset on many records
+    std::vector<Sales_data> sds;
+    for (unsigned i = 0; i != 200000; ++i) {
+      sds.emplace_back("978-" + std::to_string(i % 50000), i % 7, i * 0.25);
+    }
+    std::unordered_multiset<Sales_data> std_set;
+    flat_hash_multiset<Sales_data> flat_set;
+    auto t0 = std::chrono::steady_clock::now();
+    for (const auto &sd : sds) {
+      std_set.insert(sd);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (const auto &sd : sds) {
+      flat_set.insert(sd);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+    size_t std_hits = 0, flat_hits = 0;
+    for (const auto &sd : sds) {
+      std_hits += std_set.count(sd);
+    }
+    auto t3 = std::chrono::steady_clock::now();
+    for (const auto &sd : sds) {
+      flat_hits += flat_set.count(sd);
+    }
+    auto t4 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> std_ins = t1 - t0,
+                                              flat_ins = t2 - t1,
+                                              std_find = t3 - t2,
+                                              flat_find = t4 - t3;
+    std::cout << "unordered_multiset: " << std_ins.count() << " ms insert, "
+              << std_find.count() << " ms lookup (" << std_hits << " hits)\n"
+              << "flat_hash_multiset: " << flat_ins.count() << " ms insert, "
+              << flat_find.count() << " ms lookup (" << flat_hits << " hits)"
+              << std::endl;
+    flat_set.erase(sds[0]);
+    std::cout << std::boolalpha << flat_set.contains(sds[0]) << ' '
+              << flat_set.size() << std::noboolalpha << std::endl;
+  }
+
   {
     Foo_<std::string> fs;
     fs.Bar(); // instantiates Foo_<std::string>::Bar()
@@ -3,17 +3,49 @@
 //
 
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <bitset>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <fstream>
+#include <functional>
 #include <iomanip>
 #include <iostream>
+#include <iterator>
 #include <list>
+#include <memory>
+#include <mutex>
 #include <numeric>
+#include <queue>
 #include <random>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <tuple>
+#include <unordered_map>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "isbn.hpp"
+
 /* -------------------------------- BookStore ------------------------------- */
 
 class Sales_data {
@@ -26,21 +58,40 @@ class Sales_data {
   friend bool operator==(const Sales_data &, const Sales_data &);
   friend bool operator!=(const Sales_data &, const Sales_data &);
   friend class std::hash<Sales_data>;
+  friend class Sales_columns;
+  friend class Sales_cents;
+  friend class sales_log;
+  friend class sales_wal;
+  friend class sales_segment;
+  friend struct by_revenue;
+  friend struct by_units;
+  friend class price_quantiles;
+  friend void write_sales_log(const std::vector<std::vector<Sales_data>> &,
+                              const std::string &, std::uint32_t);
+  friend std::vector<Sales_data> total_by_isbn(const std::vector<Sales_data> &);
+  friend std::vector<Sales_data> total_by_isbn(const std::vector<Sales_data> &,
+                                               unsigned);
 
 public:
-  Sales_data(const std::string &s, unsigned n, double p)
+  Sales_data(const Isbn &s, unsigned n, double p)
       : bookNo(s), units_sold(n), revenue(p * n) {}
-  Sales_data() : Sales_data("", 0, 0) {}
-  Sales_data(const std::string &s) : Sales_data(s, 0, 0) {}
+  // throws std::invalid_argument if s is not an ISBN
+  Sales_data(const std::string &s, unsigned n, double p)
+      : Sales_data(Isbn(s), n, p) {}
+  Sales_data() : Sales_data(Isbn(), 0, 0) {}
+  Sales_data(const Isbn &s) : Sales_data(s, 0, 0) {}
+  // throws std::invalid_argument if s is not an ISBN
+  explicit Sales_data(const std::string &s) : Sales_data(Isbn(s), 0, 0) {}
   explicit Sales_data(std::istream &is) : Sales_data() { read(is, *this); }
 
-  std::string isbn() const { return bookNo; } // implicitly inline
+  // the canonical ISBN-13, which is how the book prints
+  const Isbn &isbn() const { return bookNo; } // implicitly inline
   Sales_data &combine(const Sales_data &);
 
   Sales_data &operator+=(const Sales_data &);
 
 private:
-  std::string bookNo;
+  Isbn bookNo;
   unsigned units_sold = 0;
   double revenue = 0.0;
 
@@ -59,6 +110,15 @@ Sales_data add(const Sales_data &lhs, const Sales_data &rhs) {
   return sum;
 }
 
+// a word that cannot be an ISBN fails the stream, like a bad number
+std::istream &operator>>(std::istream &is, Isbn &isbn) {
+  std::string word;
+  if (is >> word && !Isbn::parse(word, isbn)) {
+    is.setstate(std::ios::failbit);
+  }
+  return is;
+}
+
 std::istream &read(std::istream &is, Sales_data &item) {
   double price = 0.0;
   is >> item.bookNo >> item.units_sold >> price;
@@ -102,7 +162,7 @@ Sales_data operator+(const Sales_data &lhs, const Sales_data &rhs) {
 }
 
 bool operator==(const Sales_data &lhs, const Sales_data &rhs) {
-  return lhs.isbn() == rhs.isbn() && lhs.units_sold == rhs.units_sold &&
+  return lhs.bookNo == rhs.bookNo && lhs.units_sold == rhs.units_sold &&
          lhs.revenue == rhs.revenue;
 }
 
@@ -118,9 +178,21 @@ template <> struct hash<Sales_data> {
   size_t operator()(const Sales_data &s) const;
 };
 
+// XOR-ing the member hashes let equal ones cancel, so the members are
+// folded in with wyhash's multiply-and-fold step, as in chpt16; the key
+// needs no hash of its own first
+static inline uint64_t wymix(uint64_t a, uint64_t b) {
+  auto r = static_cast<unsigned __int128>(a) * b;
+  return static_cast<uint64_t>(r) ^ static_cast<uint64_t>(r >> 64);
+}
+
 size_t hash<Sales_data>::operator()(const Sales_data &s) const {
-  return hash<string>()(s.bookNo) ^ hash<unsigned>()(s.units_sold) ^
-         hash<double>()(s.revenue);
+  double rev = s.revenue == 0 ? 0 : s.revenue; // -0.0 == 0.0
+  uint64_t bits;
+  memcpy(&bits, &rev, sizeof(bits));
+  uint64_t h = s.bookNo.key();
+  h = wymix(h ^ 0xa0761d6478bd642full, s.units_sold ^ 0xe7037ed1a0b428dbull);
+  return wymix(h ^ bits ^ 0x8ebc6af09c88c6e3ull, 0x589965cc75374cc3ull);
 }
 } // namespace std
 
@@ -128,6 +200,20 @@ bool compareIsbn(const Sales_data &lhs, const Sales_data &rhs) {
   return lhs.isbn() < rhs.isbn();
 }
 
+// std::accumulate as of C++17 computes `init = init + *b`, where init is an
+// lvalue, so each step copies the running total. These add into one total
+// in place instead.
+template <typename It> Sales_data sum_sales(It b, It e, Sales_data init) {
+  for (; b != e; ++b) {
+    init += *b;
+  }
+  return init;
+}
+
+template <typename It> Sales_data sum_sales(It b, It e) {
+  return b == e ? Sales_data() : sum_sales(std::next(b), e, *b);
+}
+
 typedef std::tuple<std::vector<Sales_data>::size_type,
                    std::vector<Sales_data>::const_iterator,
                    std::vector<Sales_data>::const_iterator>
@@ -136,10 +222,14 @@ typedef std::tuple<std::vector<Sales_data>::size_type,
 std::vector<matches> findBook(const std::vector<std::vector<Sales_data>> &files,
                               const std::string &book) {
   std::vector<matches> ret;
+  Isbn key;
+  if (!Isbn::parse(book, key)) {
+    return ret; // not an ISBN, so in no store
+  }
 
   for (auto it = files.cbegin(); it != files.cend(); ++it) {
     auto found =
-        std::equal_range(it->cbegin(), it->cend(), book,
+        std::equal_range(it->cbegin(), it->cend(), Sales_data(key),
                          [](const Sales_data &lhs, const Sales_data &rhs) {
                            return lhs.isbn() < rhs.isbn();
                          });
@@ -158,13 +248,73 @@ void reportResults(std::istream &in, std::ostream &os,
   while (in >> s) {
     auto trans = findBook(files, s);
     if (trans.empty()) {
-      std::cout << s << " not found in any stores" << std::endl;
+      os << s << " not found in any stores" << std::endl;
+      continue;
+    }
+    for (const auto &store : trans) {
+      os << "store " << std::get<0>(store) << " sales: "
+         << sum_sales(std::get<1>(store), std::get<2>(store), Sales_data(s))
+         << std::endl;
+    }
+  }
+}
+
+// Batch mode: reads every query first, sorts and dedups them, then walks
+// each store once in step with the sorted queries (a merge join), so the
+// stores are read sequentially instead of being binary-searched per query.
+// The report comes out in the original query order.
+void reportResults_batch(std::istream &in, std::ostream &os,
+                         const std::vector<std::vector<Sales_data>> &files) {
+  std::vector<std::string> queries{std::istream_iterator<std::string>(in),
+                                   std::istream_iterator<std::string>()};
+  std::vector<Isbn> books;
+  for (const auto &s : queries) {
+    Isbn key;
+    if (Isbn::parse(s, key)) {
+      books.push_back(key);
+    }
+  }
+  std::sort(books.begin(), books.end());
+  books.erase(std::unique(books.begin(), books.end()), books.end());
+
+  std::vector<std::vector<matches>> found(books.size());
+  for (auto it = files.cbegin(); it != files.cend(); ++it) {
+    auto rec = it->cbegin();
+    auto q = books.cbegin();
+    while (rec != it->cend() && q != books.cend()) {
+      const auto &isbn = rec->isbn();
+      if (isbn < *q) {
+        ++rec;
+      } else if (*q < isbn) {
+        ++q;
+      } else {
+        auto end = rec;
+        while (end != it->cend() && end->isbn() == *q) {
+          ++end;
+        }
+        found[q - books.cbegin()].push_back(
+            std::make_tuple(it - files.cbegin(), rec, end));
+        rec = end;
+        ++q;
+      }
+    }
+  }
+
+  static const std::vector<matches> none;
+  for (const auto &s : queries) {
+    Isbn key;
+    const auto &trans =
+        Isbn::parse(s, key)
+            ? found[std::lower_bound(books.cbegin(), books.cend(), key) -
+                    books.cbegin()]
+            : none;
+    if (trans.empty()) {
+      os << s << " not found in any stores" << std::endl;
       continue;
     }
     for (const auto &store : trans) {
       os << "store " << std::get<0>(store) << " sales: "
-         << std::accumulate(std::get<1>(store), std::get<2>(store),
-                            Sales_data(s))
+         << sum_sales(std::get<1>(store), std::get<2>(store), Sales_data(s))
          << std::endl;
     }
   }
@@ -172,35 +322,3107 @@ void reportResults(std::istream &in, std::ostream &os,
 
 /* -------------------------------------------------------------------------- */
 
-// this function generates the SAME sequence on each call
-std::vector<unsigned> bad_randVec() {
-  std::default_random_engine e;
-  std::uniform_int_distribution<unsigned> u(0, 9);
+/* -------------------------- Parallel Store Search ------------------------- */
 
-  std::vector<unsigned> ret;
-  for (size_t i = 0; i != 100; ++i) {
-    ret.push_back(u(e));
+// a fixed set of threads working through a queue of tasks
+class thread_pool {
+public:
+  explicit thread_pool(unsigned n = std::thread::hardware_concurrency());
+  thread_pool(const thread_pool &) = delete;
+  thread_pool &operator=(const thread_pool &) = delete;
+  ~thread_pool(); // runs whatever is still queued, then joins
+
+  // Runs f(0), ..., f(n - 1), f(0) on the calling thread and the rest on
+  // the pool, and returns once all have, rethrowing the first exception.
+  // There is no future per call, and each queued task fits in
+  // std::function's own buffer, so no task needs an allocation of its own.
+  template <typename F> void run(unsigned n, F f);
+  unsigned size() const { return workers.size(); }
+
+private:
+  std::vector<std::thread> workers;
+  std::queue<std::function<void()>> tasks;
+  std::mutex mtx;
+  std::condition_variable cv;
+  bool done = false;
+};
+
+thread_pool::thread_pool(unsigned n) {
+  for (unsigned i = 0; i != std::max(1u, n); ++i) {
+    workers.emplace_back([this] {
+      while (true) {
+        std::function<void()> task;
+        {
+          std::unique_lock<std::mutex> lock(mtx);
+          cv.wait(lock, [this] { return done || !tasks.empty(); });
+          if (tasks.empty()) {
+            return; // done, and nothing left to run
+          }
+          task = std::move(tasks.front());
+          tasks.pop();
+        }
+        task();
+      }
+    });
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    std::lock_guard<std::mutex> lock(mtx);
+    done = true;
+  }
+  cv.notify_all();
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+template <typename F> void thread_pool::run(unsigned n, F f) {
+  struct job_state {
+    F *f;
+    unsigned left;
+    std::exception_ptr err;
+    std::mutex mtx;
+    std::condition_variable cv;
+
+    void run(unsigned i) {
+      std::exception_ptr e;
+      try {
+        (*f)(i);
+      } catch (...) {
+        e = std::current_exception();
+      }
+      std::lock_guard<std::mutex> lock(mtx);
+      if (e && !err) {
+        err = e;
+      }
+      if (--left == 0) {
+        cv.notify_one();
+      }
+    }
+  } job;
+  job.f = &f;
+  job.left = n;
+  if (n > 1) {
+    {
+      std::lock_guard<std::mutex> lock(mtx);
+      for (unsigned i = 1; i != n; ++i) {
+        tasks.push([&job, i] { job.run(i); });
+      }
+    }
+    cv.notify_all();
+  }
+  if (n) {
+    job.run(0);
+  }
+  std::unique_lock<std::mutex> lock(job.mtx);
+  job.cv.wait(lock, [&job] { return job.left == 0; });
+  if (job.err) {
+    std::rethrow_exception(job.err);
+  }
+}
+
+// Below this many stores per thread, handing the stores to another thread
+// and waiting for it costs more than searching them here; see the demo.
+constexpr std::size_t pool_min_stores = 512;
+
+// findBook with the stores searched concurrently on `pool`: they are cut
+// into one slice per thread, the caller's included, but no more slices
+// than give each at least `min_stores`, and with a single slice the search
+// stays serial. Each slice collects its own matches, and the slices are
+// joined in store order, so the result is the same as findBook(files,
+// book).
+std::vector<matches> findBook(thread_pool &pool,
+                              const std::vector<std::vector<Sales_data>> &files,
+                              const std::string &book,
+                              std::size_t min_stores = pool_min_stores) {
+  typedef std::vector<std::vector<Sales_data>>::size_type size_type;
+  const size_type slices = std::min<size_type>(
+      pool.size() + 1, files.size() / std::max<size_type>(min_stores, 1));
+  if (slices < 2) {
+    return findBook(files, book);
+  }
+  Isbn key;
+  if (!Isbn::parse(book, key)) {
+    return {};
+  }
+  const Sales_data target(key);
+  std::vector<std::vector<matches>> parts(slices);
+  pool.run(slices, [&](unsigned s) {
+    for (size_type i = files.size() * s / slices,
+                   end = files.size() * (s + 1) / slices;
+         i != end; ++i) {
+      auto found =
+          std::equal_range(files[i].cbegin(), files[i].cend(), target,
+                           [](const Sales_data &lhs, const Sales_data &rhs) {
+                             return lhs.isbn() < rhs.isbn();
+                           });
+      if (found.first != found.second) {
+        parts[s].push_back(std::make_tuple(i, found.first, found.second));
+      }
+    }
+  });
+  size_type n = 0;
+  for (const auto &part : parts) {
+    n += part.size();
+  }
+  std::vector<matches> ret;
+  ret.reserve(n);
+  for (const auto &part : parts) {
+    ret.insert(ret.end(), part.cbegin(), part.cend());
   }
   return ret;
 }
 
-// static objects preserve their states throughout the program
-// new numbers generated on each call
-std::vector<unsigned> good_randVec() {
-  static std::default_random_engine e;
-  static std::uniform_int_distribution<unsigned> u(0, 9);
+/* -------------------------------------------------------------------------- */
 
-  std::vector<unsigned> ret;
-  for (size_t i = 0; i != 100; ++i) {
-    ret.push_back(u(e));
+/* -------------------------- ISBN Inverted Index --------------------------- */
+
+// Built once over `files`, which must not change afterwards: for every
+// ISBN, the (store, begin, end) ranges findBook would return, in store
+// order. Answering a query is then a single hash lookup.
+class isbn_index {
+public:
+  explicit isbn_index(const std::vector<std::vector<Sales_data>> &files);
+
+  const std::vector<matches> &find(const std::string &book) const {
+    Isbn key;
+    if (!Isbn::parse(book, key)) {
+      return none;
+    }
+    auto it = index.find(key);
+    return it == index.cend() ? none : it->second;
+  }
+  std::size_t size() const { return index.size(); }
+
+private:
+  std::unordered_map<Isbn, std::vector<matches>> index;
+  static const std::vector<matches> none;
+};
+
+const std::vector<matches> isbn_index::none;
+
+isbn_index::isbn_index(const std::vector<std::vector<Sales_data>> &files) {
+  for (auto it = files.cbegin(); it != files.cend(); ++it) {
+    // each store is sorted, so a book's records are adjacent
+    for (auto beg = it->cbegin(); beg != it->cend();) {
+      auto end = std::find_if(beg, it->cend(), [&](const Sales_data &s) {
+        return compareIsbn(*beg, s);
+      });
+      index[beg->isbn()].push_back(
+          std::make_tuple(it - files.cbegin(), beg, end));
+      beg = end;
+    }
+  }
+}
+
+const std::vector<matches> &findBook(const isbn_index &index,
+                                     const std::string &book) {
+  return index.find(book);
+}
+
+void reportResults(std::istream &in, std::ostream &os,
+                   const isbn_index &index) {
+  std::string s;
+  while (in >> s) {
+    const auto &trans = findBook(index, s);
+    if (trans.empty()) {
+      os << s << " not found in any stores" << std::endl;
+      continue;
+    }
+    for (const auto &store : trans) {
+      os << "store " << std::get<0>(store) << " sales: "
+         << sum_sales(std::get<1>(store), std::get<2>(store), Sales_data(s))
+         << std::endl;
+    }
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ------------------------- Per-ISBN Totals View --------------------------- */
+
+// Owns the stores and keeps, for every ISBN, what reportResults would
+// print: the book's total in each store that sells it, in store order.
+// append adds a transaction to a store and
+// folds it into those totals in place, so a query is one hash lookup no
+// matter how many transactions there are. Appended records go to the end
+// of their store, which therefore stops being sorted; the view itself
+// does not depend on the order.
+class sales_totals {
+public:
+  typedef std::vector<Sales_data>::size_type size_type;
+  typedef std::vector<std::pair<size_type, Sales_data>> store_totals;
+
+  explicit sales_totals(std::vector<std::vector<Sales_data>> files);
+
+  void append(size_type store, const Sales_data &item);
+
+  const store_totals &find(const std::string &book) const {
+    Isbn key;
+    if (!Isbn::parse(book, key)) {
+      return none;
+    }
+    auto it = books.find(key);
+    return it == books.cend() ? none : it->second;
+  }
+  Sales_data total(const std::string &book) const; // over all stores
+  const std::vector<std::vector<Sales_data>> &stores() const { return files; }
+
+  // true if every total equals one recomputed from the stores
+  bool check() const;
+
+private:
+  std::vector<std::vector<Sales_data>> files;
+  std::unordered_map<Isbn, store_totals> books; // sorted by store
+  static const store_totals none;
+
+  void add(size_type store, const Sales_data &item);
+};
+
+const sales_totals::store_totals sales_totals::none;
+
+sales_totals::sales_totals(std::vector<std::vector<Sales_data>> f)
+    : files(std::move(f)) {
+  for (size_type i = 0; i != files.size(); ++i) {
+    for (const auto &item : files[i]) {
+      add(i, item);
+    }
+  }
+}
+
+void sales_totals::append(size_type store, const Sales_data &item) {
+  if (store >= files.size()) {
+    files.resize(store + 1);
+  }
+  files[store].push_back(item);
+  add(store, item);
+}
+
+// A book is usually in a handful of stores and records arrive store by
+// store, so the store's entry is nearly always the last one.
+void sales_totals::add(size_type store, const Sales_data &item) {
+  auto &st = books[item.isbn()];
+  auto it = !st.empty() && st.back().first == store
+                ? st.end() - 1
+                : std::lower_bound(st.begin(), st.end(), store,
+                                   [](const std::pair<size_type, Sales_data> &e,
+                                      size_type s) { return e.first < s; });
+  if (it == st.end() || it->first != store) {
+    it = st.insert(it, {store, Sales_data(item.isbn())});
+  }
+  it->second += item;
+}
+
+Sales_data sales_totals::total(const std::string &book) const {
+  Sales_data ret(book);
+  for (const auto &s : find(book)) {
+    ret += s.second;
   }
   return ret;
 }
 
+bool sales_totals::check() const {
+  std::unordered_map<Isbn, store_totals> fresh;
+  for (size_type i = 0; i != files.size(); ++i) {
+    for (const auto &item : files[i]) {
+      auto &st = fresh[item.isbn()];
+      if (st.empty() || st.back().first != i) {
+        st.push_back({i, Sales_data(item.isbn())});
+      }
+      st.back().second += item;
+    }
+  }
+  return fresh == books;
+}
+
+void reportResults(std::istream &in, std::ostream &os,
+                   const sales_totals &view) {
+  std::string s;
+  while (in >> s) {
+    const auto &trans = view.find(s);
+    if (trans.empty()) {
+      os << s << " not found in any stores" << std::endl;
+      continue;
+    }
+    for (const auto &store : trans) {
+      os << "store " << store.first << " sales: " << store.second
+         << std::endl;
+    }
+  }
+}
+
 /* -------------------------------------------------------------------------- */
 
-int main() {
-  { std::cout << "Hello World!" << std::endl; }
+/* ------------------------- Per-Store Bloom Filters ------------------------ */
+
+// A set of ISBNs in m bits that answers "maybe" or "certainly not":
+// each key sets k bits, found by double hashing (bit i is h1 + i * h2), so
+// a key that was added always finds its bits set, and a key that was not
+// finds them all set only with probability about (1 - e^(-kn/m))^k.
+class bloom_filter {
+public:
+  bloom_filter(std::size_t keys, unsigned bits_per_key);
+
+  void add(const Isbn &key);
+  bool may_contain(const Isbn &key) const;
+
+  std::size_t bytes() const { return bits.size() * sizeof(std::uint64_t); }
+  double false_positive_rate() const; // expected, for the keys added
+
+private:
+  std::vector<std::uint64_t> bits;
+  std::uint64_t nbits;
+  unsigned k;
+  std::size_t added = 0;
+
+  template <typename F>
+  static void probe(const Isbn &key, unsigned k, std::uint64_t nbits, F f) {
+    std::uint64_t h = std::hash<Isbn>()(key);
+    std::uint64_t h2 = (h >> 32 | h << 32) * 0x9e3779b97f4a7c15ull | 1;
+    for (unsigned i = 0; i != k; ++i, h += h2) {
+      if (!f(h % nbits)) {
+        return;
+      }
+    }
+  }
+};
+
+bloom_filter::bloom_filter(std::size_t keys, unsigned bits_per_key)
+    : bits((std::max<std::size_t>(keys, 1) * bits_per_key + 63) / 64),
+      nbits(bits.size() * 64),
+      k(std::max(1u, static_cast<unsigned>(bits_per_key * 0.69 + 0.5))) {}
+
+void bloom_filter::add(const Isbn &key) {
+  probe(key, k, nbits, [this](std::uint64_t b) {
+    bits[b / 64] |= 1ull << b % 64;
+    return true;
+  });
+  ++added;
+}
+
+bool bloom_filter::may_contain(const Isbn &key) const {
+  bool ret = true;
+  probe(key, k, nbits, [&](std::uint64_t b) {
+    return ret = bits[b / 64] >> b % 64 & 1;
+  });
+  return ret;
+}
+
+double bloom_filter::false_positive_rate() const {
+  return std::pow(1 - std::exp(-double(k) * added / nbits), k);
+}
+
+// One filter over the ISBNs of each store, built when the stores are
+// loaded; `files` must not change afterwards. findBook then skips every
+// store whose filter rules the book out, and binary-searches only the rest.
+class store_filters {
+public:
+  explicit store_filters(const std::vector<std::vector<Sales_data>> &files,
+                         unsigned bits_per_key = 10);
+
+  bool may_contain(std::size_t store, const Isbn &book) const {
+    return filters[store].may_contain(book);
+  }
+  std::size_t bytes() const;
+  double false_positive_rate() const; // mean over the stores
+
+private:
+  std::vector<bloom_filter> filters;
+};
+
+store_filters::store_filters(const std::vector<std::vector<Sales_data>> &files,
+                             unsigned bits_per_key) {
+  for (const auto &f : files) {
+    // each store is sorted, so distinct books are the changes of ISBN
+    std::size_t books = 0;
+    for (auto it = f.cbegin(); it != f.cend(); ++it) {
+      books += it == f.cbegin() || compareIsbn(*(it - 1), *it);
+    }
+    filters.emplace_back(books, bits_per_key);
+    for (auto it = f.cbegin(); it != f.cend(); ++it) {
+      if (it == f.cbegin() || compareIsbn(*(it - 1), *it)) {
+        filters.back().add(it->isbn());
+      }
+    }
+  }
+}
+
+std::size_t store_filters::bytes() const {
+  std::size_t ret = 0;
+  for (const auto &f : filters) {
+    ret += f.bytes();
+  }
+  return ret;
+}
+
+double store_filters::false_positive_rate() const {
+  double sum = 0;
+  for (const auto &f : filters) {
+    sum += f.false_positive_rate();
+  }
+  return filters.empty() ? 0 : sum / filters.size();
+}
+
+std::vector<matches> findBook(const store_filters &filters,
+                              const std::vector<std::vector<Sales_data>> &files,
+                              const std::string &book) {
+  std::vector<matches> ret;
+  Isbn key;
+  if (!Isbn::parse(book, key)) {
+    return ret;
+  }
+  const Sales_data target(key);
+  for (auto it = files.cbegin(); it != files.cend(); ++it) {
+    if (!filters.may_contain(it - files.cbegin(), key)) {
+      continue;
+    }
+    auto found =
+        std::equal_range(it->cbegin(), it->cend(), target, compareIsbn);
+    if (found.first != found.second) {
+      ret.push_back(
+          std::make_tuple(it - files.cbegin(), found.first, found.second));
+    }
+  }
+  return ret;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* -------------------------- Merged Store Stream --------------------------- */
+
+// Every record of every store in ISBN order, each with the store it came
+// from, as if the stores had been concatenated and stably sorted, but
+// without copying or sorting anything. Each store must already be sorted
+// by ISBN, as findBook assumes. The merge is a tournament ("loser") tree:
+// node n (1 <= n < k) holds the key and store of the loser of the match
+// played there and nodes k .. 2k-1 are the stores themselves, so replacing
+// the winner replays just the log2(k) matches on its path, comparing keys
+// kept in the tree rather than chasing pointers into the stores. Records
+// with the same ISBN come out in store order.
+class store_merge {
+public:
+  typedef std::vector<Sales_data>::size_type size_type;
+  struct value_type {
+    size_type store;
+    const Sales_data *item;
+  };
+
+  explicit store_merge(const std::vector<std::vector<Sales_data>> &files);
+
+  bool empty() const { return !k || winner.key == done; }
+  value_type front() const { return {winner.store, cur[winner.store]}; }
+  void pop();
+
+private:
+  struct entry {
+    std::uint64_t key; // of the store's next record, or done
+    size_type store;
+  };
+  // greater than any Isbn key, which is an ISBN-13 and so below 10^13
+  static constexpr std::uint64_t done = ~std::uint64_t(0);
+
+  size_type k;
+  entry winner = {done, 0};
+  std::vector<const Sales_data *> cur, last;
+  std::vector<entry> losers; // losers[0] is unused
+
+  static bool beats(const entry &a, const entry &b) {
+    return a.key < b.key || (a.key == b.key && a.store < b.store);
+  }
+  entry play(size_type node);
+};
+
+store_merge::store_merge(const std::vector<std::vector<Sales_data>> &files)
+    : k(files.size()), cur(k), last(k), losers(k) {
+  for (size_type i = 0; i != k; ++i) {
+    cur[i] = files[i].data();
+    last[i] = cur[i] + files[i].size();
+  }
+  if (k) {
+    winner = play(1);
+  }
+}
+
+store_merge::entry store_merge::play(size_type node) {
+  if (node >= k) {
+    size_type s = node - k;
+    return {cur[s] == last[s] ? done : cur[s]->isbn().key(), s};
+  }
+  entry a = play(2 * node), b = play(2 * node + 1);
+  if (beats(b, a)) {
+    std::swap(a, b);
+  }
+  losers[node] = b;
+  return a;
+}
+
+// The k stores are read in k interleaved streams, more than the hardware
+// prefetcher follows, so the winner's store is prefetched a few records on.
+void store_merge::pop() {
+  entry w = winner;
+  const Sales_data *&next = cur[w.store];
+  if (last[w.store] - next > 4) {
+    __builtin_prefetch(next + 4);
+  }
+  w.key = ++next == last[w.store] ? done : next->isbn().key();
+  for (size_type node = (w.store + k) / 2; node; node /= 2) {
+    entry l = losers[node];
+    bool lost = beats(l, w); // selects rather than branches
+    losers[node] = lost ? w : l;
+    w = lost ? l : w;
+  }
+  winner = w;
+}
+
+// What reportResults prints for every book in any store, in ISBN order, in
+// one sequential pass over the stores.
+void reportAll(std::ostream &os,
+               const std::vector<std::vector<Sales_data>> &files) {
+  store_merge merged(files);
+  while (!merged.empty()) {
+    auto first = merged.front();
+    Sales_data total(first.item->isbn());
+    for (; !merged.empty(); merged.pop()) {
+      auto rec = merged.front();
+      if (rec.store != first.store ||
+          rec.item->isbn() != first.item->isbn()) {
+        break;
+      }
+      total += *rec.item;
+    }
+    os << "store " << first.store << " sales: " << total << std::endl;
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* -------------------------- Columnar Sales Store -------------------------- */
+
+// The same transactions as a vector<Sales_data>, stored column by column:
+// each ISBN is replaced by a small id into a dictionary, and the ids, units
+// and revenue live in contiguous arrays of their own. Aggregates then read
+// only the columns they need, straight through memory. The columnar stores
+// differ only in the type of the revenue column, `Revenue`, and in the
+// aggregates they build on it.
+template <typename Revenue> class basic_sales_columns {
+public:
+  typedef std::vector<unsigned>::size_type size_type;
+  typedef std::uint32_t isbn_id;
+  static constexpr isbn_id no_id = ~isbn_id(0);
+
+  void push_back(const Isbn &isbn, unsigned n, Revenue rev);
+  void reserve(size_type n);
+
+  size_type size() const { return units.size(); }
+  bool empty() const { return units.empty(); }
+
+  isbn_id id(const std::string &isbn) const; // no_id if never seen
+  const Isbn &isbn(isbn_id i) const { return isbns[i]; }
+  std::size_t isbn_count() const { return isbns.size(); }
+
+  unsigned long long total_units() const;
+
+protected:
+  std::vector<isbn_id> ids;
+  std::vector<unsigned> units;
+  std::vector<Revenue> revenue;
+
+private:
+  std::vector<Isbn> isbns;
+  std::unordered_map<Isbn, isbn_id> lookup;
+};
+
+template <typename Revenue>
+void basic_sales_columns<Revenue>::push_back(const Isbn &isbn, unsigned n,
+                                             Revenue rev) {
+  auto ret = lookup.insert({isbn, static_cast<isbn_id>(isbns.size())});
+  if (ret.second) {
+    isbns.push_back(isbn);
+  }
+  ids.push_back(ret.first->second);
+  units.push_back(n);
+  revenue.push_back(rev);
+}
+
+template <typename Revenue>
+void basic_sales_columns<Revenue>::reserve(size_type n) {
+  ids.reserve(n);
+  units.reserve(n);
+  revenue.reserve(n);
+}
+
+template <typename Revenue>
+typename basic_sales_columns<Revenue>::isbn_id
+basic_sales_columns<Revenue>::id(const std::string &isbn) const {
+  Isbn key;
+  if (!Isbn::parse(isbn, key)) {
+    return no_id;
+  }
+  auto it = lookup.find(key);
+  return it == lookup.cend() ? no_id : it->second;
+}
+
+template <typename Revenue>
+unsigned long long basic_sales_columns<Revenue>::total_units() const {
+  unsigned long long sum = 0;
+  for (auto n : units) {
+    sum += n;
+  }
+  return sum;
+}
+
+// revenue as a double, like Sales_data
+class Sales_columns : public basic_sales_columns<double> {
+public:
+  Sales_columns() = default;
+  template <typename It> Sales_columns(It b, It e) {
+    for (; b != e; ++b) {
+      push_back(*b);
+    }
+  }
+
+  using basic_sales_columns::push_back;
+  void push_back(const Sales_data &item) {
+    push_back(item.bookNo, item.units_sold, item.revenue);
+  }
+
+  Sales_data operator[](size_type i) const;
+
+  double total_revenue() const;
+  double avg_price() const;
+  Sales_data total(const std::string &book) const; // one book's sales
+};
+
+Sales_data Sales_columns::operator[](size_type i) const {
+  Sales_data item(isbn(ids[i]));
+  item.units_sold = units[i];
+  item.revenue = revenue[i];
+  return item;
+}
+
+// The loops below keep `lanes` independent partial sums. Integer sums
+// vectorize as they are; for doubles the separate accumulators are what
+// lets the compiler use SIMD without reassociating (-ffast-math), and they
+// fix the summation order, so results do not depend on the compiler.
+constexpr std::size_t lanes = 8;
+
+double Sales_columns::total_revenue() const {
+  double acc[lanes] = {};
+  const double *r = revenue.data();
+  size_type n = revenue.size(), i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    for (std::size_t l = 0; l != lanes; ++l) {
+      acc[l] += r[i + l];
+    }
+  }
+  for (; i != n; ++i) {
+    acc[0] += r[i];
+  }
+  double sum = 0;
+  for (auto a : acc) {
+    sum += a;
+  }
+  return sum;
+}
+
+double Sales_columns::avg_price() const {
+  auto n = total_units();
+  return n ? total_revenue() / n : 0;
+}
+
+// a filtered sum: branch-free masks rather than an `if` per row
+Sales_data Sales_columns::total(const std::string &book) const {
+  Sales_data ret(book);
+  const isbn_id want = id(book);
+  if (want == no_id) {
+    return ret;
+  }
+  double acc[lanes] = {};
+  unsigned long long cnt[lanes] = {};
+  const isbn_id *d = ids.data();
+  const unsigned *u = units.data();
+  const double *r = revenue.data();
+  size_type n = ids.size(), i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    for (std::size_t l = 0; l != lanes; ++l) {
+      bool hit = d[i + l] == want;
+      cnt[l] += hit ? u[i + l] : 0;
+      acc[l] += hit ? r[i + l] : 0.0;
+    }
+  }
+  for (; i != n; ++i) {
+    bool hit = d[i] == want;
+    cnt[0] += hit ? u[i] : 0;
+    acc[0] += hit ? r[i] : 0.0;
+  }
+  unsigned long long units_sum = 0;
+  double rev_sum = 0;
+  for (std::size_t l = 0; l != lanes; ++l) {
+    units_sum += cnt[l];
+    rev_sum += acc[l];
+  }
+  ret.units_sold = units_sum;
+  ret.revenue = rev_sum;
+  return ret;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ------------------------ Bulk Transaction Parser ------------------------- */
+
+// read-only mapping of a whole file
+class mapped_file {
+public:
+  explicit mapped_file(const std::string &path);
+  mapped_file(const mapped_file &) = delete;
+  mapped_file &operator=(const mapped_file &) = delete;
+  ~mapped_file() {
+    if (len) {
+      munmap(addr, len);
+    }
+  }
+
+  const char *data() const { return static_cast<const char *>(addr); }
+  std::size_t size() const { return len; }
+
+private:
+  void *addr = nullptr;
+  std::size_t len = 0;
+};
+
+mapped_file::mapped_file(const std::string &path) {
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+  }
+  struct stat st;
+  if (fstat(fd, &st) == 0 && st.st_size > 0) {
+    len = st.st_size;
+    addr = mmap(nullptr, len, PROT_READ, MAP_SHARED, fd, 0);
+  }
+  int err = errno;
+  close(fd);
+  if (addr == MAP_FAILED) {
+    len = 0;
+    throw std::runtime_error("cannot map " + path + ": " + strerror(err));
+  }
+}
+
+// Clinger's fast path: a decimal with at most 15 significant digits and 22
+// fraction digits is one exact integer divided by an exact power of ten,
+// so a single division gives the correctly rounded double. Anything else
+// (exponents, long mantissas) is left to from_chars.
+std::from_chars_result parse_price(const char *beg, const char *end,
+                                   double &value) {
+  static const double pow10[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,
+                                 1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+                                 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+                                 1e18, 1e19, 1e20, 1e21, 1e22};
+  std::uint64_t mantissa = 0;
+  int digits = 0, frac = -1; // frac counts digits after the point
+  const char *p = beg;
+  for (; p != end; ++p) {
+    if (*p >= '0' && *p <= '9') {
+      mantissa = mantissa * 10 + (*p - '0');
+      if (mantissa && ++digits > 15) {
+        break;
+      }
+      if (frac >= 0 && ++frac > 22) {
+        break;
+      }
+    } else if (*p == '.' && frac < 0) {
+      frac = 0;
+    } else {
+      break;
+    }
+  }
+  if (p == end && p != beg && frac != 0) {
+    value = frac > 0 ? mantissa / pow10[frac] : double(mantissa);
+    return {p, std::errc()};
+  }
+  return std::from_chars(beg, end, value);
+}
+
+#ifdef __SSE2__
+// bit k set where byte k of the 32 at p separates fields (<= ' '), and in
+// `nl` where it is a newline
+inline std::uint32_t separators(const char *p, std::uint32_t &nl) {
+  __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p)),
+          hi = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16));
+  __m128i space = _mm_set1_epi8(' '), newline = _mm_set1_epi8('\n');
+  auto le = [space](__m128i v) {
+    return _mm_cmpeq_epi8(_mm_min_epu8(v, space), v);
+  };
+  auto mask = [](__m128i a, __m128i b) {
+    return std::uint32_t(_mm_movemask_epi8(a)) |
+           std::uint32_t(_mm_movemask_epi8(b)) << 16;
+  };
+  nl = mask(_mm_cmpeq_epi8(lo, newline), _mm_cmpeq_epi8(hi, newline));
+  return mask(le(lo), le(hi));
+}
+
+// the first k >= i with bit k of m set, or 32 if there is none
+inline unsigned first_set(std::uint32_t m, unsigned i) {
+  return __builtin_ctzll((std::uint64_t(m) | 1ull << 32) & ~0ull << i);
+}
+#endif
+
+// a line parse_sales could not read
+struct parse_error {
+  std::size_t line;   // counting from 1
+  std::size_t offset; // of the start of the line
+  std::string reason;
+};
+
+// Reads "isbn units price" records, one per line, from [beg, end) without
+// going through formatted stream extraction: fields are split by hand (any
+// space or control character separates them) and the numbers are read
+// without regard to the locale. Every good record goes to
+// sink(isbn, units, price); a bad line is noted in `errors` and skipped.
+// Blank lines are ignored. With SSE2, the fields of a line are found from a
+// mask of the separators in its first 32 bytes, and the byte loops only
+// take over past those.
+template <typename Sink>
+void parse_sales(const char *beg, const char *end, Sink sink,
+                 std::vector<parse_error> &errors) {
+  auto blank = [](char c) {
+    return static_cast<unsigned char>(c) <= ' ' && c != '\n';
+  };
+  const char *const start = beg;
+  for (std::size_t line = 1; beg != end; ++line) {
+    const char *p = beg;
+#ifdef __SSE2__
+    std::uint32_t nl = 0, seps = end - beg >= 32 ? separators(beg, nl) : 0;
+    const char *window = end - beg >= 32 ? beg + 32 : beg;
+#endif
+    auto field = [&]() {
+#ifdef __SSE2__
+      if (p < window) {
+        p = beg + first_set(~seps | nl, p - beg);
+      }
+#endif
+      while (p != end && blank(*p)) {
+        ++p;
+      }
+      const char *f = p;
+#ifdef __SSE2__
+      if (p < window) {
+        p = beg + first_set(seps, p - beg);
+      }
+#endif
+      while (p != end && static_cast<unsigned char>(*p) > ' ') {
+        ++p;
+      }
+      return std::string_view(f, p - f);
+    };
+    auto isbn_text = field(), units_text = field(), price_text = field(),
+         rest = field();
+    const char *why = nullptr;
+    Isbn isbn;
+    unsigned units = 0;
+    double price = 0;
+    if (isbn_text.empty()) {
+      // blank line
+    } else if (!Isbn::parse(isbn_text, isbn)) {
+      why = "bad ISBN";
+    } else if (units_text.empty()) {
+      why = "missing units";
+    } else if (price_text.empty()) {
+      why = "missing price";
+    } else if (!rest.empty()) {
+      why = "trailing characters";
+    } else {
+      auto u = std::from_chars(units_text.data(),
+                               units_text.data() + units_text.size(), units);
+      auto pr = parse_price(price_text.data(),
+                            price_text.data() + price_text.size(), price);
+      if (u.ec != std::errc() ||
+          u.ptr != units_text.data() + units_text.size()) {
+        why = "bad units";
+      } else if (pr.ec != std::errc() ||
+                 pr.ptr != price_text.data() + price_text.size()) {
+        why = "bad price";
+      } else {
+        sink(isbn, units, price);
+      }
+    }
+    if (why) {
+      errors.push_back({line, std::size_t(beg - start), why});
+    }
+    if (p != end && *p != '\n') { // more than four fields; skip the rest
+      p = static_cast<const char *>(memchr(p, '\n', end - p));
+      p = p ? p : end;
+    }
+    beg = p == end ? end : p + 1;
+  }
+}
+
+// An upper bound on the records in [beg, end), so the overloads below can
+// reserve room for them all: a vectorized count of the newlines costs far
+// less than growing the output as it fills.
+std::size_t max_records(const char *beg, const char *end) {
+  return std::count(beg, end, '\n') + (beg != end && end[-1] != '\n');
+}
+
+void parse_sales(const char *beg, const char *end, std::vector<Sales_data> &out,
+                 std::vector<parse_error> &errors) {
+  out.reserve(out.size() + max_records(beg, end));
+  parse_sales(
+      beg, end,
+      [&out](const Isbn &isbn, unsigned n, double p) {
+        out.emplace_back(isbn, n, p);
+      },
+      errors);
+}
+
+void parse_sales(const char *beg, const char *end, Sales_columns &out,
+                 std::vector<parse_error> &errors) {
+  out.reserve(out.size() + max_records(beg, end));
+  parse_sales(
+      beg, end,
+      [&out](const Isbn &isbn, unsigned n, double p) {
+        out.push_back(isbn, n, p * n);
+      },
+      errors);
+}
+
+// the same over a mapped file
+template <typename Out>
+std::vector<parse_error> parse_sales_file(const std::string &path, Out &out) {
+  mapped_file f(path);
+  std::vector<parse_error> errors;
+  parse_sales(f.data(), f.data() + f.size(), out, errors);
+  return errors;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ------------------------ Parallel Group-By-ISBN -------------------------- */
+
+// one Sales_data per book, in ISBN order; the loop we want to speed up
+std::vector<Sales_data> total_by_isbn(const std::vector<Sales_data> &items) {
+  std::unordered_map<Isbn, Sales_data> totals;
+  for (const auto &item : items) {
+    auto ret = totals.insert({item.bookNo, Sales_data(item.bookNo)});
+    ret.first->second.combine(item);
+  }
+  std::vector<Sales_data> ret;
+  for (auto &t : totals) {
+    ret.push_back(std::move(t.second));
+  }
+  std::sort(ret.begin(), ret.end(), compareIsbn);
+  return ret;
+}
+
+// The same totals using `threads` threads. First every thread takes a
+// contiguous chunk of the records and buckets their indices by a hash of
+// the ISBN, one bucket per thread. Then every thread owns one bucket
+// number and combines that bucket from each chunk, chunk by chunk, so each
+// book is summed in exactly the order of the serial loop and the totals
+// come out bit for bit the same.
+std::vector<Sales_data> total_by_isbn(const std::vector<Sales_data> &items,
+                                      unsigned threads) {
+  if (!threads) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  typedef std::vector<Sales_data>::size_type size_type;
+  std::vector<std::vector<std::vector<size_type>>> buckets(
+      threads, std::vector<std::vector<size_type>>(threads));
+  std::vector<std::vector<Sales_data>> partial(threads);
+  std::vector<std::thread> pool;
+
+  for (unsigned c = 0; c != threads; ++c) {
+    pool.emplace_back([&, c] {
+      size_type beg = items.size() * c / threads,
+                end = items.size() * (c + 1) / threads;
+      std::hash<Isbn> h;
+      for (size_type i = beg; i != end; ++i) {
+        buckets[c][h(items[i].bookNo) % threads].push_back(i);
+      }
+    });
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+  pool.clear();
+
+  for (unsigned p = 0; p != threads; ++p) {
+    pool.emplace_back([&, p] {
+      std::unordered_map<Isbn, Sales_data> totals;
+      for (unsigned c = 0; c != threads; ++c) {
+        for (auto i : buckets[c][p]) {
+          const auto &item = items[i];
+          auto ret = totals.insert({item.bookNo, Sales_data(item.bookNo)});
+          ret.first->second.combine(item);
+        }
+      }
+      for (auto &t : totals) {
+        partial[p].push_back(std::move(t.second));
+      }
+      std::sort(partial[p].begin(), partial[p].end(), compareIsbn);
+    });
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+
+  // every partition is sorted and no book is in two of them
+  std::vector<Sales_data> ret;
+  for (auto &part : partial) {
+    auto mid = ret.size();
+    ret.insert(ret.end(), std::make_move_iterator(part.begin()),
+               std::make_move_iterator(part.end()));
+    std::inplace_merge(ret.begin(), ret.begin() + mid, ret.end(), compareIsbn);
+  }
+  return ret;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ---------------------------- Streaming Top-N ----------------------------- */
+
+// best-first orders for totals; ties go to the smaller ISBN, so the top
+// books do not depend on the order they arrive in
+struct by_revenue {
+  bool operator()(const Sales_data &lhs, const Sales_data &rhs) const {
+    return lhs.revenue != rhs.revenue ? lhs.revenue > rhs.revenue
+                                      : lhs.bookNo < rhs.bookNo;
+  }
+};
+
+struct by_units {
+  bool operator()(const Sales_data &lhs, const Sales_data &rhs) const {
+    return lhs.units_sold != rhs.units_sold ? lhs.units_sold > rhs.units_sold
+                                            : lhs.bookNo < rhs.bookNo;
+  }
+};
+
+// The n best items pushed so far, under a best-first order `better`, in a
+// heap with the worst of them on top. An item that is not better than the
+// top is dropped after one comparison, so memory stays at n items however
+// long the stream is.
+template <typename T, typename Better> class top_n {
+public:
+  explicit top_n(std::size_t n, Better b = Better()) : n(n), better(b) {
+    heap.reserve(n);
+  }
+
+  void push(const T &t);
+  void merge(const top_n &other) {
+    for (const auto &t : other.heap) {
+      push(t);
+    }
+  }
+  std::vector<T> sorted() const; // best first
+
+private:
+  std::size_t n;
+  Better better;
+  std::vector<T> heap;
+};
+
+template <typename T, typename Better> void top_n<T, Better>::push(const T &t) {
+  if (heap.size() < n) {
+    heap.push_back(t);
+    std::push_heap(heap.begin(), heap.end(), better);
+  } else if (n && better(t, heap.front())) {
+    std::pop_heap(heap.begin(), heap.end(), better);
+    heap.back() = t;
+    std::push_heap(heap.begin(), heap.end(), better);
+  }
+}
+
+template <typename T, typename Better>
+std::vector<T> top_n<T, Better>::sorted() const {
+  std::vector<T> ret(heap);
+  std::sort(ret.begin(), ret.end(), better);
+  return ret;
+}
+
+// Adds up each run of records with the same ISBN in [b, e), which must be
+// sorted by ISBN, and keeps the n best totals.
+template <typename Better, typename It>
+top_n<Sales_data, Better> top_books(It b, It e, std::size_t n,
+                                    Better better = Better()) {
+  top_n<Sales_data, Better> top(n, better);
+  while (b != e) {
+    Sales_data total(b->isbn());
+    auto run = b;
+    for (; b != e && !compareIsbn(*run, *b); ++b) {
+      total += *b;
+    }
+    top.push(total);
+  }
+  return top;
+}
+
+// The same with `threads` threads. The records are cut into chunks at
+// changes of ISBN, so no book is split; each thread keeps a top-n of its
+// own, and the heaps are merged at the end.
+template <typename Better>
+std::vector<Sales_data> top_books(const std::vector<Sales_data> &sorted,
+                                  std::size_t n, unsigned threads,
+                                  Better better = Better()) {
+  if (!threads) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<std::vector<Sales_data>::const_iterator> cuts{sorted.cbegin()};
+  for (unsigned c = 1; c != threads; ++c) {
+    auto cut = std::max(cuts.back(), sorted.cbegin() + sorted.size() * c /
+                                                           threads);
+    cuts.push_back(cut == sorted.cbegin() || cut == sorted.cend()
+                       ? cut
+                       : std::upper_bound(cut, sorted.cend(), *(cut - 1),
+                                          compareIsbn));
+  }
+  cuts.push_back(sorted.cend());
+
+  std::vector<top_n<Sales_data, Better>> partial(threads,
+                                                 top_n<Sales_data, Better>(0));
+  std::vector<std::thread> pool;
+  for (unsigned c = 0; c != threads; ++c) {
+    pool.emplace_back([&, c] {
+      partial[c] = top_books(cuts[c], cuts[c + 1], n, better);
+    });
+  }
+  top_n<Sales_data, Better> top(n, better);
+  for (unsigned c = 0; c != threads; ++c) {
+    pool[c].join();
+    top.merge(partial[c]);
+  }
+  return top.sorted();
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ------------------------- Price Quantile Sketch -------------------------- */
+
+// A KLL sketch: approximate quantiles of a stream in O(k) memory. Items
+// sit in levels, and an item at level h stands for 2^h of the originals.
+// When the levels outgrow their capacities (k at the top, shrinking by 2/3
+// per level down), the lowest full level is sorted and every other item,
+// from a random start, moves up a level with twice the weight; the rest
+// are dropped. The rank error is about 1.7 / k of the count with high
+// probability. Two sketches merge by concatenating their levels and
+// compacting, so per-thread or per-store sketches combine into one.
+class kll_sketch {
+public:
+  explicit kll_sketch(unsigned k = 200) : k(k), levels(1) {}
+
+  void add(double x, std::uint64_t weight = 1);
+  void merge(const kll_sketch &other);
+
+  double quantile(double q) const; // q in [0, 1]; NaN if empty
+  std::uint64_t count() const { return n; }
+  std::size_t retained() const;
+
+private:
+  unsigned k;
+  std::uint64_t n = 0;
+  std::vector<std::vector<double>> levels;
+  std::uint64_t coin = 0x9e3779b97f4a7c15ull; // xorshift state
+
+  std::size_t capacity(std::size_t h) const {
+    double c = k * std::pow(2.0 / 3, levels.size() - 1 - h);
+    return std::max<std::size_t>(2, static_cast<std::size_t>(c));
+  }
+  void compact();
+};
+
+// A weight of w is w copies of x: one item at level h for each bit h of w.
+void kll_sketch::add(double x, std::uint64_t weight) {
+  n += weight;
+  for (std::size_t h = 0; weight; ++h, weight >>= 1) {
+    if (weight & 1) {
+      if (h >= levels.size()) {
+        levels.resize(h + 1);
+      }
+      levels[h].push_back(x);
+    }
+  }
+  compact();
+}
+
+void kll_sketch::merge(const kll_sketch &other) {
+  if (other.levels.size() > levels.size()) {
+    levels.resize(other.levels.size());
+  }
+  for (std::size_t h = 0; h != other.levels.size(); ++h) {
+    levels[h].insert(levels[h].end(), other.levels[h].cbegin(),
+                     other.levels[h].cend());
+  }
+  n += other.n;
+  compact();
+}
+
+std::size_t kll_sketch::retained() const {
+  std::size_t ret = 0;
+  for (const auto &l : levels) {
+    ret += l.size();
+  }
+  return ret;
+}
+
+void kll_sketch::compact() {
+  for (;;) {
+    std::size_t size = 0, cap = 0;
+    for (std::size_t h = 0; h != levels.size(); ++h) {
+      size += levels[h].size();
+      cap += capacity(h);
+    }
+    if (size <= cap) {
+      return;
+    }
+    std::size_t h = 0;
+    while (levels[h].size() < capacity(h)) {
+      ++h;
+    }
+    if (h + 1 == levels.size()) {
+      levels.emplace_back();
+    }
+    auto &l = levels[h];
+    std::sort(l.begin(), l.end());
+    coin ^= coin << 13;
+    coin ^= coin >> 7;
+    coin ^= coin << 17;
+    // an odd item out stays behind, so the weight moved up is exact
+    double odd = 0;
+    bool has_odd = l.size() % 2;
+    if (has_odd) {
+      odd = l.back();
+      l.pop_back();
+    }
+    for (std::size_t i = coin & 1; i < l.size(); i += 2) {
+      levels[h + 1].push_back(l[i]);
+    }
+    l.clear();
+    if (has_odd) {
+      l.push_back(odd);
+    }
+  }
+}
+
+double kll_sketch::quantile(double q) const {
+  std::vector<std::pair<double, std::uint64_t>> items;
+  for (std::size_t h = 0; h != levels.size(); ++h) {
+    for (auto x : levels[h]) {
+      items.push_back({x, std::uint64_t(1) << h});
+    }
+  }
+  if (items.empty()) {
+    return std::nan("");
+  }
+  std::sort(items.begin(), items.end());
+  auto rank = static_cast<std::uint64_t>(std::ceil(q * n));
+  std::uint64_t seen = 0;
+  for (const auto &it : items) {
+    seen += it.second;
+    if (seen >= rank) {
+      return it.first;
+    }
+  }
+  return items.back().first;
+}
+
+// a sketch of the unit price of every copy sold, per ISBN
+class price_quantiles {
+public:
+  explicit price_quantiles(unsigned k = 200) : k(k) {}
+
+  void add(const Sales_data &item) {
+    if (item.units_sold) {
+      sketches.try_emplace(item.bookNo, k)
+          .first->second.add(item.avg_price(), item.units_sold);
+    }
+  }
+  void merge(const price_quantiles &other) {
+    for (const auto &s : other.sketches) {
+      sketches.try_emplace(s.first, k).first->second.merge(s.second);
+    }
+  }
+  const kll_sketch *find(const std::string &book) const {
+    Isbn key;
+    if (!Isbn::parse(book, key)) {
+      return nullptr;
+    }
+    auto it = sketches.find(key);
+    return it == sketches.cend() ? nullptr : &it->second;
+  }
+
+private:
+  unsigned k;
+  std::unordered_map<Isbn, kll_sketch> sketches;
+};
+
+/* -------------------------------------------------------------------------- */
+
+/* -------------------------- Fixed-Point Revenue --------------------------- */
+
+// Money as a whole number of cents. Integer sums are exact and associative:
+// totals do not drift, and they come out the same however the records are
+// split between threads.
+typedef std::int64_t cents;
+
+// to the nearest cent, halves away from zero
+cents to_cents(double dollars) {
+  double c = std::round(dollars * 100);
+  if (!(std::fabs(c) < 9.2e18)) {
+    throw std::overflow_error("amount out of range for cents");
+  }
+  return static_cast<cents>(c);
+}
+
+std::string format_cents(cents c) {
+  std::ostringstream os;
+  auto mag = c < 0 ? 0 - static_cast<std::uint64_t>(c) : c;
+  os << (c < 0 ? "-" : "") << mag / 100 << '.' << std::setw(2)
+     << std::setfill('0') << mag % 100;
+  return os.str();
+}
+
+// the 128-bit sum of v[0..n), in `lanes` accumulators that split each sum
+// into a low word and a count of carries out of it; the loop body is only
+// adds and compares, so it vectorizes, and nothing can overflow
+__int128 sum_cents(const cents *v, std::size_t n) {
+  std::uint64_t lo[lanes] = {};
+  std::int64_t hi[lanes] = {};
+  std::size_t i = 0;
+  for (; i + lanes <= n; i += lanes) {
+    for (std::size_t l = 0; l != lanes; ++l) {
+      std::uint64_t s = lo[l] + static_cast<std::uint64_t>(v[i + l]);
+      hi[l] += (s < lo[l]) - (v[i + l] < 0);
+      lo[l] = s;
+    }
+  }
+  __int128 sum = 0;
+  for (; i != n; ++i) {
+    sum += v[i];
+  }
+  for (std::size_t l = 0; l != lanes; ++l) {
+    // a multiply, as a negative value must not be shifted
+    sum += static_cast<__int128>(hi[l]) * (static_cast<__int128>(1) << 64) +
+           lo[l];
+  }
+  return sum;
+}
+
+cents narrow_cents(__int128 sum) {
+  if (sum > INT64_MAX || sum < INT64_MIN) {
+    throw std::overflow_error("revenue total overflows 64-bit cents");
+  }
+  return static_cast<cents>(sum);
+}
+
+// total / units to the nearest cent, halves away from zero
+cents avg_price(cents total, unsigned long long units) {
+  if (!units) {
+    return 0;
+  }
+  __int128 q = total / static_cast<__int128>(units),
+           r = total % static_cast<__int128>(units);
+  if (2 * (r < 0 ? -r : r) >= units) {
+    q += total < 0 ? -1 : 1;
+  }
+  return static_cast<cents>(q);
+}
+
+// Sales_columns with revenue kept in cents
+class Sales_cents : public basic_sales_columns<cents> {
+public:
+  struct totals {
+    unsigned long long units = 0;
+    cents revenue = 0;
+    cents avg_price() const { return ::avg_price(revenue, units); }
+  };
+
+  Sales_cents() = default;
+  template <typename It> Sales_cents(It b, It e) {
+    for (; b != e; ++b) {
+      push_back(*b);
+    }
+  }
+
+  using basic_sales_columns::push_back;
+  void push_back(const Sales_data &item) {
+    push_back(item.bookNo, item.units_sold, to_cents(item.revenue));
+  }
+
+  cents total_revenue(unsigned threads = 1) const;
+  cents avg_price() const {
+    return ::avg_price(total_revenue(), total_units());
+  }
+  totals total(const std::string &book) const; // one book's sales
+};
+
+// each thread sums a contiguous chunk; the exact partial sums add up to
+// the same total in any grouping
+cents Sales_cents::total_revenue(unsigned threads) const {
+  if (!threads) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  std::vector<__int128> partial(threads);
+  std::vector<std::thread> pool;
+  for (unsigned c = 0; c != threads; ++c) {
+    pool.emplace_back([&, c] {
+      size_type beg = revenue.size() * c / threads,
+                end = revenue.size() * (c + 1) / threads;
+      partial[c] = sum_cents(revenue.data() + beg, end - beg);
+    });
+  }
+  __int128 sum = 0;
+  for (unsigned c = 0; c != threads; ++c) {
+    pool[c].join();
+    sum += partial[c];
+  }
+  return narrow_cents(sum);
+}
+
+Sales_cents::totals Sales_cents::total(const std::string &book) const {
+  totals ret;
+  const isbn_id want = id(book);
+  if (want == no_id) {
+    return ret;
+  }
+  __int128 rev = 0;
+  for (size_type i = 0; i != ids.size(); ++i) {
+    bool hit = ids[i] == want;
+    ret.units += hit ? units[i] : 0;
+    rev += hit ? revenue[i] : 0;
+  }
+  ret.revenue = narrow_cents(rev);
+  return ret;
+}
+
+void parse_sales(const char *beg, const char *end, Sales_cents &out,
+                 std::vector<parse_error> &errors) {
+  out.reserve(out.size() + max_records(beg, end));
+  parse_sales(
+      beg, end,
+      [&out](const Isbn &isbn, unsigned n, double p) {
+        cents line;
+        if (__builtin_mul_overflow(to_cents(p), static_cast<cents>(n), &line)) {
+          throw std::overflow_error("line total overflows 64-bit cents");
+        }
+        out.push_back(isbn, n, line);
+      },
+      errors);
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ------------------------ Compressed Sales Segment ------------------------ */
+
+// An immutable, compressed copy of a run of transactions. ISBNs become ids
+// into a sorted dictionary, and revenue is kept per record in whole cents,
+// as Sales_cents keeps it, so any record it takes can be stored; negative
+// revenue is stored with the sign bit flipped, which keeps the order of the
+// values for the packing below. The records are cut into blocks of
+// block_size; in each block, every column is stored as offsets from the
+// block's smallest value, bit-packed at the width of the largest offset.
+// Repeated ISBNs, small unit counts and similar amounts thus take a few
+// bits each. Scans unpack a block at a time into small arrays
+// with a loop the compiler vectorizes, and add those up; a query for one
+// book skips every block whose id range does not contain it.
+class sales_segment {
+public:
+  typedef std::vector<Sales_data>::size_type size_type;
+  static constexpr size_type block_size = 128;
+
+  template <typename It> sales_segment(It b, It e);
+
+  size_type size() const { return count; }
+  std::size_t bytes() const; // memory used, dictionary included
+
+  unsigned long long total_units() const;
+  cents total_revenue() const;
+  Sales_cents::totals total(const std::string &book) const;
+
+private:
+  struct column {
+    std::uint64_t base;
+    std::uint32_t offset; // of the first packed word
+    std::uint8_t width;   // bits per value
+  };
+  struct block {
+    std::uint32_t first_id, last_id; // range of ids in the block
+    std::uint32_t n;
+    column ids, units, revenue;
+  };
+
+  size_type count = 0;
+  std::vector<Isbn> isbns;
+  std::vector<block> blocks;
+  std::vector<std::uint64_t> words; // one spare word at the end
+
+  column pack(const std::uint64_t *v, size_type n);
+  static void unpack(const std::uint64_t *in, const column &c, size_type n,
+                     std::uint64_t *out);
+
+  // cents to and from the unsigned values packed, in the same order
+  static std::uint64_t to_unsigned(cents c) {
+    return static_cast<std::uint64_t>(c) ^ 1ull << 63;
+  }
+  static cents to_signed(std::uint64_t v) {
+    return static_cast<cents>(v ^ 1ull << 63);
+  }
+};
+
+template <typename It> sales_segment::sales_segment(It b, It e) {
+  for (auto it = b; it != e; ++it) {
+    isbns.push_back(it->isbn());
+  }
+  std::sort(isbns.begin(), isbns.end());
+  isbns.erase(std::unique(isbns.begin(), isbns.end()), isbns.end());
+
+  std::uint64_t ids[block_size], units[block_size], revenue[block_size];
+  while (b != e) {
+    size_type n = 0;
+    for (; n != block_size && b != e; ++n, ++b) {
+      ids[n] = std::lower_bound(isbns.cbegin(), isbns.cend(), b->isbn()) -
+               isbns.cbegin();
+      units[n] = b->units_sold;
+      revenue[n] = to_unsigned(to_cents(b->revenue));
+    }
+    block blk;
+    blk.first_id = *std::min_element(ids, ids + n);
+    blk.last_id = *std::max_element(ids, ids + n);
+    blk.n = n;
+    blk.ids = pack(ids, n);
+    blk.units = pack(units, n);
+    blk.revenue = pack(revenue, n);
+    blocks.push_back(blk);
+    count += n;
+  }
+  words.push_back(0);
+  words.shrink_to_fit();
+}
+
+std::size_t sales_segment::bytes() const {
+  return isbns.size() * sizeof(Isbn) + blocks.size() * sizeof(block) +
+         words.size() * sizeof(std::uint64_t);
+}
+
+sales_segment::column sales_segment::pack(const std::uint64_t *v,
+                                          size_type n) {
+  column c;
+  c.base = *std::min_element(v, v + n);
+  std::uint64_t span = *std::max_element(v, v + n) - c.base;
+  c.width = span ? 64 - __builtin_clzll(span) : 0;
+  c.offset = words.size();
+  words.resize(words.size() + (n * c.width + 63) / 64);
+  for (size_type i = 0; i != n && c.width; ++i) {
+    std::uint64_t x = v[i] - c.base;
+    size_type bit = i * c.width, w = c.offset + bit / 64, shift = bit % 64;
+    words[w] |= x << shift;
+    if (shift + c.width > 64) {
+      words[w + 1] |= x >> (64 - shift);
+    }
+  }
+  return c;
+}
+
+// Any 64 consecutive values of width W fill exactly W words. With W a
+// constant, every value's word and shift within such a group is a constant
+// too, so a group unpacks as straight-line code of loads, constant shifts
+// and masks; each width gets its own copy. A short final block is read
+// value by value; the spare word at the end keeps the pair of words each
+// value is read from in bounds.
+template <unsigned W, std::size_t I>
+inline std::uint64_t packed_field(const std::uint64_t *in) {
+  constexpr std::uint64_t mask = W == 64 ? ~0ull : (1ull << W) - 1;
+  constexpr std::size_t word = I * W / 64, shift = I * W % 64;
+  if constexpr (shift + W <= 64) {
+    return (in[word] >> shift) & mask;
+  } else {
+    return ((in[word] >> shift) | (in[word + 1] << (64 - shift))) & mask;
+  }
+}
+
+template <unsigned W, std::size_t... I>
+inline void unpack_group(const std::uint64_t *in, std::uint64_t base,
+                         std::uint64_t *out, std::index_sequence<I...>) {
+  ((out[I] = base + packed_field<W, I>(in)), ...);
+}
+
+template <unsigned W>
+void unpack_width(const std::uint64_t *in, std::uint64_t base,
+                  sales_segment::size_type n, std::uint64_t *out) {
+  std::size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    unpack_group<W>(in + i / 64 * W, base, out + i,
+                    std::make_index_sequence<64>());
+  }
+  constexpr std::uint64_t mask = W == 64 ? ~0ull : (1ull << W) - 1;
+  for (; i != n; ++i) {
+    std::size_t bit = i * W, shift = bit % 64;
+    std::uint64_t lo = in[bit / 64], hi = in[bit / 64 + 1];
+    out[i] = base + (((lo >> shift) | (hi << 1 << (63 - shift))) & mask);
+  }
+}
+
+template <std::size_t... W>
+constexpr auto unpackers(std::index_sequence<W...>) {
+  typedef void (*unpacker)(const std::uint64_t *, std::uint64_t,
+                           sales_segment::size_type, std::uint64_t *);
+  return std::array<unpacker, sizeof...(W)>{{unpack_width<W + 1>...}};
+}
+
+void sales_segment::unpack(const std::uint64_t *in, const column &c,
+                           size_type n, std::uint64_t *out) {
+  static constexpr auto by_width = unpackers(std::make_index_sequence<64>());
+  if (!c.width) {
+    std::fill(out, out + n, c.base);
+  } else {
+    by_width[c.width - 1](in + c.offset, c.base, n, out);
+  }
+}
+
+unsigned long long sales_segment::total_units() const {
+  unsigned long long sum = 0;
+  std::uint64_t units[block_size];
+  for (const auto &blk : blocks) {
+    unpack(words.data(), blk.units, blk.n, units);
+    for (size_type i = 0; i != blk.n; ++i) {
+      sum += units[i];
+    }
+  }
+  return sum;
+}
+
+cents sales_segment::total_revenue() const {
+  __int128 sum = 0;
+  std::uint64_t packed[block_size];
+  cents revenue[block_size];
+  for (const auto &blk : blocks) {
+    unpack(words.data(), blk.revenue, blk.n, packed);
+    for (size_type i = 0; i != blk.n; ++i) {
+      revenue[i] = to_signed(packed[i]);
+    }
+    sum += sum_cents(revenue, blk.n);
+  }
+  return narrow_cents(sum);
+}
+
+Sales_cents::totals sales_segment::total(const std::string &book) const {
+  Sales_cents::totals ret;
+  Isbn key;
+  if (!Isbn::parse(book, key)) {
+    return ret;
+  }
+  auto it = std::lower_bound(isbns.cbegin(), isbns.cend(), key);
+  if (it == isbns.cend() || *it != key) {
+    return ret;
+  }
+  const std::uint64_t want = it - isbns.cbegin();
+  __int128 rev = 0;
+  std::uint64_t ids[block_size], units[block_size], revenue[block_size];
+  for (const auto &blk : blocks) {
+    if (want < blk.first_id || want > blk.last_id) {
+      continue;
+    }
+    unpack(words.data(), blk.ids, blk.n, ids);
+    unpack(words.data(), blk.units, blk.n, units);
+    unpack(words.data(), blk.revenue, blk.n, revenue);
+    for (size_type i = 0; i != blk.n; ++i) {
+      bool hit = ids[i] == want;
+      ret.units += hit ? units[i] : 0;
+      rev += hit ? to_signed(revenue[i]) : 0;
+    }
+  }
+  ret.revenue = narrow_cents(rev);
+  return ret;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ------------------------- Binary Transaction Log ------------------------- */
+
+// Sorted stores in a file that is queried in place through mmap:
+//
+//   log_header | log_store[stores] | block keys | log_record[records]
+//
+// Each store's records are sorted by ISBN and contiguous, and ISBNs are
+// stored as their 64-bit Isbn keys. The key of every block_size-th record
+// of a store is copied into the block keys, so a lookup binary-searches
+// the small, dense keys first and then at most a block or two of records.
+// Opening a log reads and checks the header and the store table and nothing
+// else; the pages a query needs are faulted in as it touches them. Integers
+// are in the byte order of the machine that wrote the file.
+struct log_header {
+  char magic[8]; // "SALESLOG"
+  std::uint32_t version;
+  std::uint32_t block_size; // records per block key
+  std::uint64_t stores;
+  std::uint64_t blocks;
+  std::uint64_t records;
+  std::uint64_t records_off; // offsets are from the start of the file
+};
+
+struct log_store {
+  std::uint64_t first_record; // indices into the record and key arrays
+  std::uint64_t records;
+  std::uint64_t first_block;
+  std::uint64_t blocks;
+};
+
+struct log_record {
+  std::uint64_t isbn; // Isbn::key()
+  std::uint32_t units;
+  double revenue;
+};
+
+constexpr std::uint32_t log_version = 3;
+
+void write_sales_log(const std::vector<std::vector<Sales_data>> &files,
+                     const std::string &path, std::uint32_t block_size = 64) {
+  log_header h = {{'S', 'A', 'L', 'E', 'S', 'L', 'O', 'G'}, log_version,
+                  block_size, files.size(), 0, 0, 0};
+  std::vector<log_store> stores;
+  for (const auto &f : files) {
+    if (!std::is_sorted(f.cbegin(), f.cend(), compareIsbn)) {
+      throw std::runtime_error("store " + std::to_string(stores.size()) +
+                               " is not sorted by ISBN");
+    }
+    std::uint64_t blocks = (f.size() + block_size - 1) / block_size;
+    stores.push_back({h.records, f.size(), h.blocks, blocks});
+    h.records += f.size();
+    h.blocks += blocks;
+  }
+  h.records_off = sizeof(h) + stores.size() * sizeof(log_store) +
+                  h.blocks * sizeof(std::uint64_t);
+
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  out.write(reinterpret_cast<const char *>(&h), sizeof(h));
+  out.write(reinterpret_cast<const char *>(stores.data()),
+            stores.size() * sizeof(log_store));
+  for (const auto &f : files) {
+    for (std::size_t i = 0; i < f.size(); i += block_size) {
+      std::uint64_t k = f[i].bookNo.key();
+      out.write(reinterpret_cast<const char *>(&k), sizeof(k));
+    }
+  }
+  for (const auto &f : files) {
+    for (const auto &item : f) {
+      log_record r = {};
+      r.isbn = item.bookNo.key();
+      r.units = item.units_sold;
+      r.revenue = item.revenue;
+      out.write(reinterpret_cast<const char *>(&r), sizeof(r));
+    }
+  }
+  if (!out) {
+    throw std::runtime_error("cannot write " + path);
+  }
+}
+
+class sales_log {
+public:
+  explicit sales_log(const std::string &path);
+
+  std::size_t stores() const { return header().stores; }
+  std::size_t records() const { return header().records; }
+  const log_record *begin(std::size_t store) const {
+    return recs + store_table[store].first_record;
+  }
+  const log_record *end(std::size_t store) const {
+    return begin(store) + store_table[store].records;
+  }
+
+  // the records of `book` in one store
+  std::pair<const log_record *, const log_record *>
+  find(std::size_t store, const Isbn &book) const;
+
+  // the records in [b, e) added up, as Sales_data(book) + ... would
+  static Sales_data sum(const Isbn &book, const log_record *b,
+                        const log_record *e);
+
+private:
+  mapped_file file;
+  const log_store *store_table;
+  const std::uint64_t *keys;
+  const log_record *recs;
+
+  const log_header &header() const {
+    return *reinterpret_cast<const log_header *>(file.data());
+  }
+};
+
+sales_log::sales_log(const std::string &path) : file(path) {
+  if (file.size() < sizeof(log_header) ||
+      memcmp(header().magic, "SALESLOG", 8) ||
+      header().version != log_version) {
+    throw std::runtime_error(path + " is not a sales log");
+  }
+  const auto &h = header();
+  if (h.records_off > file.size() ||
+      (file.size() - h.records_off) / sizeof(log_record) < h.records) {
+    throw std::runtime_error(path + " is truncated");
+  }
+  // The counts come from the file, so they are checked by division rather
+  // than by sums that could wrap: the store table and block keys must fit
+  // between the header and the records, and every store inside them.
+  auto room = h.records_off - sizeof(h);
+  if (h.records_off < sizeof(h) || h.records_off % alignof(log_record) ||
+      h.stores > room / sizeof(log_store) ||
+      h.blocks >
+          (room - h.stores * sizeof(log_store)) / sizeof(std::uint64_t) ||
+      h.block_size == 0) {
+    throw std::runtime_error(path + " is corrupt");
+  }
+  store_table = reinterpret_cast<const log_store *>(file.data() + sizeof(h));
+  for (std::uint64_t i = 0; i != h.stores; ++i) {
+    const auto &s = store_table[i];
+    // find() steps through a store's records a block at a time
+    auto blocks = s.records / h.block_size + (s.records % h.block_size != 0);
+    if (s.first_record > h.records || s.records > h.records - s.first_record ||
+        s.first_block > h.blocks || s.blocks > h.blocks - s.first_block ||
+        s.blocks != blocks) {
+      throw std::runtime_error(path + " is corrupt");
+    }
+  }
+  keys = reinterpret_cast<const std::uint64_t *>(store_table + h.stores);
+  recs = reinterpret_cast<const log_record *>(file.data() + h.records_off);
+}
+
+std::pair<const log_record *, const log_record *>
+sales_log::find(std::size_t store, const Isbn &book) const {
+  const auto &s = store_table[store];
+  const std::uint64_t *kb = keys + s.first_block, *ke = kb + s.blocks;
+  const std::uint64_t key = book.key();
+  // the first block that could hold book, and the first past its records
+  auto lo = std::lower_bound(kb, ke, key);
+  auto hi = std::upper_bound(lo, ke, key);
+  const log_record *first = begin(store), *last = end(store);
+  const log_record *rb = lo == kb ? first
+                                  : first + (lo - kb - 1) * header().block_size;
+  const log_record *re =
+      hi == ke ? last : first + (hi - kb) * header().block_size;
+  auto lt = [](const log_record &r, std::uint64_t k) { return r.isbn < k; };
+  auto gt = [](std::uint64_t k, const log_record &r) { return k < r.isbn; };
+  rb = std::lower_bound(rb, re, key, lt);
+  return {rb, std::upper_bound(rb, re, key, gt)};
+}
+
+Sales_data sales_log::sum(const Isbn &book, const log_record *b,
+                          const log_record *e) {
+  Sales_data ret(book);
+  for (; b != e; ++b) {
+    ret.units_sold += b->units;
+    ret.revenue += b->revenue;
+  }
+  return ret;
+}
+
+typedef std::tuple<std::size_t, const log_record *, const log_record *>
+    log_matches;
+
+std::vector<log_matches> findBook(const sales_log &log,
+                                  const std::string &book) {
+  std::vector<log_matches> ret;
+  Isbn key;
+  if (!Isbn::parse(book, key)) {
+    return ret;
+  }
+  for (std::size_t i = 0; i != log.stores(); ++i) {
+    auto found = log.find(i, key);
+    if (found.first != found.second) {
+      ret.push_back(std::make_tuple(i, found.first, found.second));
+    }
+  }
+  return ret;
+}
+
+void reportResults(std::istream &in, std::ostream &os, const sales_log &log) {
+  std::string s;
+  while (in >> s) {
+    auto trans = findBook(log, s);
+    if (trans.empty()) {
+      os << s << " not found in any stores" << std::endl;
+      continue;
+    }
+    for (const auto &store : trans) {
+      os << "store " << std::get<0>(store) << " sales: "
+         << sales_log::sum(Isbn(s), std::get<1>(store), std::get<2>(store))
+         << std::endl;
+    }
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* --------------------------- External Sales Sort -------------------------- */
+
+// Sorts a transaction file of any size into a one-store sales log, in a
+// bounded amount of memory. The input is parsed straight from its mapping,
+// whose pages the kernel can drop again once the scan has passed them, into
+// runs of as many records as the budget holds; each run is stably sorted by
+// ISBN and written to a temporary file next to `out`. The runs are then
+// merged, each read and the output written through a buffer of an equal
+// share of the budget, so all the I/O is in large sequential pieces. If
+// there are too many runs for every buffer to get ext_sort_min_io bytes,
+// groups of neighbouring runs are first merged into longer ones. Records
+// with the same ISBN keep their input order, so the log is the one
+// write_sales_log would write for the stably sorted records, ready for
+// sales_log and findBook.
+constexpr std::size_t ext_sort_min_io = 1 << 16; // bytes per buffer
+
+void write_full(int fd, const void *p, std::size_t n, off_t off,
+                const std::string &path) {
+  const char *b = static_cast<const char *>(p);
+  while (n) {
+    ssize_t w = pwrite(fd, b, n, off);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      throw std::runtime_error("cannot write " + path + ": " +
+                               strerror(errno));
+    }
+    b += w;
+    n -= w;
+    off += w;
+  }
+}
+
+// fewer than n bytes only at the end of the file
+std::size_t read_full(int fd, void *p, std::size_t n, off_t off,
+                      const std::string &path) {
+  char *b = static_cast<char *>(p);
+  std::size_t got = 0;
+  while (got != n) {
+    ssize_t r = pread(fd, b + got, n - got, off + got);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r < 0) {
+      throw std::runtime_error("cannot read " + path + ": " +
+                               strerror(errno));
+    }
+    if (r == 0) {
+      break;
+    }
+    got += r;
+  }
+  return got;
+}
+
+// a temporary file of sorted records, removed along with the object
+class sort_run {
+public:
+  explicit sort_run(const std::string &p) : path(p) {
+    fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0) {
+      throw std::runtime_error("cannot create " + path + ": " +
+                               strerror(errno));
+    }
+  }
+  sort_run(const sort_run &) = delete;
+  sort_run &operator=(const sort_run &) = delete;
+  ~sort_run() {
+    close(fd);
+    unlink(path.c_str());
+  }
+
+  const std::string path;
+  int fd;
+  std::uint64_t records = 0;
+};
+
+// collects T's and writes them out in buffer-sized pieces from offset off
+template <typename T> class buffered_writer {
+public:
+  buffered_writer(int fd, const std::string &path, off_t off,
+                  std::size_t capacity)
+      : fd(fd), path(path), off(off) {
+    buf.reserve(std::max<std::size_t>(capacity, 1));
+  }
+
+  void push_back(const T &t) {
+    buf.push_back(t);
+    if (buf.size() == buf.capacity()) {
+      flush();
+    }
+  }
+  void flush() {
+    write_full(fd, buf.data(), buf.size() * sizeof(T), off, path);
+    off += buf.size() * sizeof(T);
+    buf.clear();
+  }
+
+private:
+  int fd;
+  const std::string &path;
+  off_t off;
+  std::vector<T> buf;
+};
+
+// Merges the runs in [b, e), which hold consecutive stretches of the input,
+// calling out(record) in order; equal ISBNs come from the earlier run first.
+template <typename Out>
+void merge_runs(std::list<sort_run>::iterator b,
+                std::list<sort_run>::iterator e, std::size_t buf_records,
+                Out out) {
+  struct reader {
+    sort_run *run;
+    std::vector<log_record> buf;
+    std::size_t pos = 0;
+    std::uint64_t read = 0; // records read into buf so far
+
+    bool fill(std::size_t n) {
+      std::size_t want = std::min<std::uint64_t>(n, run->records - read);
+      buf.resize(want);
+      if (read_full(run->fd, buf.data(), want * sizeof(log_record),
+                    read * sizeof(log_record),
+                    run->path) != want * sizeof(log_record)) {
+        throw std::runtime_error(run->path + " is truncated");
+      }
+      read += want;
+      pos = 0;
+      return want;
+    }
+  };
+  std::vector<reader> readers;
+  for (; b != e; ++b) {
+    readers.push_back({&*b, {}});
+  }
+  typedef std::pair<std::uint64_t, std::size_t> head; // key, reader
+  std::priority_queue<head, std::vector<head>, std::greater<head>> heads;
+  for (std::size_t i = 0; i != readers.size(); ++i) {
+    if (readers[i].fill(buf_records)) {
+      heads.push({readers[i].buf[0].isbn, i});
+    }
+  }
+  while (!heads.empty()) {
+    auto &r = readers[heads.top().second];
+    heads.pop();
+    out(r.buf[r.pos]);
+    if (++r.pos != r.buf.size() || r.fill(buf_records)) {
+      heads.push({r.buf[r.pos].isbn, std::size_t(&r - readers.data())});
+    }
+  }
+}
+
+std::vector<parse_error> sort_sales_file(const std::string &in,
+                                         const std::string &out,
+                                         std::size_t memory = 64 << 20,
+                                         std::uint32_t block_size = 64) {
+  // a run and stable_sort's scratch space of half as many records
+  const std::size_t run_records =
+      std::max<std::size_t>(memory * 2 / (3 * sizeof(log_record)), 1);
+  const std::size_t fan_in =
+      std::max<std::size_t>(memory / ext_sort_min_io, 3) - 1;
+  std::list<sort_run> runs;
+  std::size_t made = 0;
+  auto new_run = [&](std::list<sort_run>::iterator pos) {
+    return runs.emplace(pos, out + ".run" + std::to_string(made++));
+  };
+
+  std::vector<log_record> run;
+  run.reserve(run_records);
+  auto spill = [&]() {
+    std::stable_sort(run.begin(), run.end(),
+                     [](const log_record &lhs, const log_record &rhs) {
+                       return lhs.isbn < rhs.isbn;
+                     });
+    auto r = new_run(runs.end());
+    write_full(r->fd, run.data(), run.size() * sizeof(log_record), 0,
+               r->path);
+    r->records = run.size();
+    run.clear();
+  };
+  std::vector<parse_error> errors;
+  {
+    mapped_file f(in);
+    parse_sales(
+        f.data(), f.data() + f.size(),
+        [&](const Isbn &isbn, unsigned n, double p) {
+          log_record r = {};
+          r.isbn = isbn.key();
+          r.units = n;
+          r.revenue = p * n;
+          run.push_back(r);
+          if (run.size() == run_records) {
+            spill();
+          }
+        },
+        errors);
+  }
+  if (!run.empty()) {
+    spill();
+  }
+  std::vector<log_record>().swap(run);
+
+  // merge passes until one final merge can take every run
+  while (runs.size() > fan_in) {
+    std::size_t share = std::max<std::size_t>(
+        memory / ((fan_in + 1) * sizeof(log_record)), 1);
+    for (auto b = runs.begin(); b != runs.end();) {
+      auto e = b;
+      for (std::size_t i = 0; i != fan_in && e != runs.end(); ++i) {
+        ++e;
+      }
+      if (std::next(b) == e) {
+        break; // a last run on its own is left for the next pass
+      }
+      auto merged = new_run(b);
+      buffered_writer<log_record> w(merged->fd, merged->path, 0, share);
+      merge_runs(b, e, share, [&](const log_record &r) {
+        w.push_back(r);
+        ++merged->records;
+      });
+      w.flush();
+      b = runs.erase(b, e);
+    }
+  }
+
+  std::uint64_t records = 0;
+  for (const auto &r : runs) {
+    records += r.records;
+  }
+  const std::uint64_t blocks = (records + block_size - 1) / block_size;
+  log_header h = {{'S', 'A', 'L', 'E', 'S', 'L', 'O', 'G'}, log_version,
+                  block_size, 1, blocks, records, 0};
+  h.records_off =
+      sizeof(h) + sizeof(log_store) + blocks * sizeof(std::uint64_t);
+  log_store store = {0, records, 0, h.blocks};
+
+  int fd = open(out.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("cannot create " + out + ": " + strerror(errno));
+  }
+  try {
+    write_full(fd, &h, sizeof(h), 0, out);
+    write_full(fd, &store, sizeof(store), sizeof(h), out);
+    std::size_t share = std::max<std::size_t>(
+        memory / ((runs.size() + 1) * sizeof(log_record)), 1);
+    buffered_writer<std::uint64_t> keys(
+        fd, out, sizeof(h) + sizeof(store),
+        ext_sort_min_io / sizeof(std::uint64_t));
+    buffered_writer<log_record> recs(fd, out, h.records_off, share);
+    std::uint64_t n = 0;
+    merge_runs(runs.begin(), runs.end(), share, [&](const log_record &r) {
+      if (n++ % block_size == 0) {
+        keys.push_back(r.isbn);
+      }
+      recs.push_back(r);
+    });
+    keys.flush();
+    recs.flush();
+  } catch (...) {
+    close(fd);
+    unlink(out.c_str());
+    throw;
+  }
+  if (close(fd) != 0) {
+    throw std::runtime_error("cannot write " + out + ": " + strerror(errno));
+  }
+  return errors;
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* --------------------------- Write-Ahead Log ------------------------------ */
+
+// Transactions made durable before they are acknowledged:
+//
+//   wal_header | wal_record | wal_record | ...
+//
+// append only queues a record and hands back a ticket; wait(ticket) returns
+// once that record and every one before it is on disk. There is no writer
+// thread: the first waiter to find no flush in progress takes everything
+// queued so far, writes it with one write and one fdatasync, and wakes the
+// others, while records appended in the meantime queue up for the next
+// flush. Many writers, or one writer that waits every few thousand records,
+// thus share each fdatasync. Opening a log replays it, so an in-memory
+// store can be rebuilt from it, and cuts off a record torn by a crash; a
+// header torn the same way leaves an empty log.
+struct wal_header {
+  char magic[8]; // "SALESWAL"
+  std::uint32_t version;
+  std::uint32_t record_size;
+};
+
+struct wal_record {
+  std::uint64_t isbn; // Isbn::key()
+  std::uint32_t store;
+  std::uint32_t units;
+  double revenue;
+  std::uint64_t check; // wal_check of the fields above
+};
+
+constexpr std::uint32_t wal_version = 2;
+
+inline std::uint64_t wal_check(const wal_record &r) {
+  std::uint64_t rev;
+  memcpy(&rev, &r.revenue, sizeof(rev));
+  std::uint64_t h = 0x53414c4553574131ull; // never 0 for an all-zero record
+  for (std::uint64_t v : {r.isbn, std::uint64_t(r.store) << 32 | r.units,
+                          rev}) {
+    h = (h ^ v) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+class sales_wal {
+public:
+  typedef std::function<void(std::size_t, const Sales_data &)> replay_fn;
+
+  // replays the records already in the log at path, creating it if need be
+  explicit sales_wal(const std::string &path, replay_fn on_replay = nullptr);
+  sales_wal(const sales_wal &) = delete;
+  sales_wal &operator=(const sales_wal &) = delete;
+  ~sales_wal();
+
+  std::uint64_t append(std::size_t store, const Sales_data &item);
+  void wait(std::uint64_t ticket);
+  void commit(std::size_t store, const Sales_data &item) {
+    wait(append(store, item));
+  }
+  void sync();
+
+  std::size_t replayed() const { return recovered; }
+  std::uint64_t durable() const;
+
+private:
+  std::string path;
+  int fd = -1;
+  std::size_t recovered = 0;
+
+  mutable std::mutex m;
+  std::condition_variable flushed;
+  std::vector<wal_record> queued, writing; // swapped by each flush
+  std::uint64_t appended = 0, synced = 0;  // tickets
+  bool flushing = false;
+  std::string error; // set by a failed flush; the log takes no more records
+
+  void write_all(const char *p, std::size_t n);
+};
+
+sales_wal::sales_wal(const std::string &p, replay_fn on_replay) : path(p) {
+  fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+  if (fd < 0) {
+    throw std::runtime_error("cannot open " + path + ": " + strerror(errno));
+  }
+  try {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      throw std::runtime_error("cannot stat " + path + ": " + strerror(errno));
+    }
+    off_t good = sizeof(wal_header);
+    wal_header fresh = {{'S', 'A', 'L', 'E', 'S', 'W', 'A', 'L'}, wal_version,
+                        sizeof(wal_record)};
+    if (st.st_size < good) {
+      // nothing, or the start of a header whose write was cut short
+      char buf[sizeof(fresh)];
+      if (pread(fd, buf, st.st_size, 0) != st.st_size ||
+          memcmp(buf, &fresh, st.st_size)) {
+        throw std::runtime_error(path + " is not a write-ahead log");
+      }
+      write_all(reinterpret_cast<const char *>(&fresh), sizeof(fresh));
+      if (fdatasync(fd) != 0) {
+        throw std::runtime_error("cannot sync " + path + ": " +
+                                 strerror(errno));
+      }
+    } else {
+      mapped_file file(path);
+      const auto &h = *reinterpret_cast<const wal_header *>(file.data());
+      if (file.size() < sizeof(h) || memcmp(h.magic, "SALESWAL", 8) ||
+          h.version != wal_version || h.record_size != sizeof(wal_record)) {
+        throw std::runtime_error(path + " is not a write-ahead log");
+      }
+      // everything from the first torn or corrupt record on is dropped
+      const auto *r = reinterpret_cast<const wal_record *>(file.data() +
+                                                           sizeof(h));
+      std::size_t n = (file.size() - sizeof(h)) / sizeof(wal_record);
+      Isbn book;
+      for (; recovered != n; ++recovered, ++r) {
+        if (r->check != wal_check(*r) || !Isbn::from_key(r->isbn, book)) {
+          break;
+        }
+        if (on_replay) {
+          Sales_data item(book);
+          item.units_sold = r->units;
+          item.revenue = r->revenue;
+          on_replay(r->store, item);
+        }
+      }
+      good += recovered * sizeof(wal_record);
+    }
+    if (ftruncate(fd, good) != 0 || lseek(fd, good, SEEK_SET) != good) {
+      throw std::runtime_error("cannot truncate " + path + ": " +
+                               strerror(errno));
+    }
+    // the cut must be on disk before new records are: if a crash undid it,
+    // records dropped past a corrupt one could come back after them
+    if (good < st.st_size && fsync(fd) != 0) {
+      throw std::runtime_error("cannot sync " + path + ": " + strerror(errno));
+    }
+  } catch (...) {
+    close(fd);
+    throw;
+  }
+}
+
+// whatever is still queued is flushed, if it can be
+sales_wal::~sales_wal() {
+  try {
+    sync();
+  } catch (const std::exception &) {
+  }
+  close(fd);
+}
+
+std::uint64_t sales_wal::append(std::size_t store, const Sales_data &item) {
+  if (store > UINT32_MAX) {
+    throw std::out_of_range("store " + std::to_string(store) +
+                            " does not fit in a log record");
+  }
+  wal_record r = {};
+  r.isbn = item.bookNo.key();
+  r.store = store;
+  r.units = item.units_sold;
+  r.revenue = item.revenue;
+  r.check = wal_check(r);
+  std::lock_guard<std::mutex> lk(m);
+  if (!error.empty()) {
+    throw std::runtime_error(error);
+  }
+  queued.push_back(r);
+  return ++appended;
+}
+
+void sales_wal::wait(std::uint64_t ticket) {
+  std::unique_lock<std::mutex> lk(m);
+  while (synced < ticket) {
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+    if (flushing) {
+      flushed.wait(lk);
+      continue;
+    }
+    // lead the next group commit
+    flushing = true;
+    std::swap(queued, writing);
+    std::uint64_t upto = appended;
+    lk.unlock();
+    std::string err;
+    try {
+      write_all(reinterpret_cast<const char *>(writing.data()),
+                writing.size() * sizeof(wal_record));
+      if (fdatasync(fd) != 0) {
+        throw std::runtime_error("cannot sync " + path + ": " +
+                                 strerror(errno));
+      }
+    } catch (const std::runtime_error &e) {
+      err = e.what();
+    }
+    writing.clear();
+    lk.lock();
+    flushing = false;
+    if (err.empty()) {
+      synced = upto;
+    } else {
+      error = err;
+    }
+    flushed.notify_all();
+  }
+}
+
+void sales_wal::sync() {
+  std::uint64_t last;
+  {
+    std::lock_guard<std::mutex> lk(m);
+    last = appended;
+  }
+  wait(last);
+}
+
+std::uint64_t sales_wal::durable() const {
+  std::lock_guard<std::mutex> lk(m);
+  return synced;
+}
+
+void sales_wal::write_all(const char *p, std::size_t n) {
+  while (n) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0 && errno == EINTR) {
+      continue;
+    }
+    if (w <= 0) {
+      throw std::runtime_error("cannot write " + path + ": " +
+                               strerror(errno));
+    }
+    p += w;
+    n -= w;
+  }
+}
+
+/* -------------------------------------------------------------------------- */
+
+/* ----------------------------- Demo Fixtures ------------------------------ */
+
+// one of `books` made-up ISBN-10s, from 0-201-10000-2 on, drawn at random;
+// books must be at most 90000
+std::string random_isbn(std::default_random_engine &e, unsigned books = 5000) {
+  std::uniform_int_distribution<unsigned> book(0, books - 1);
+  auto digits = "0201" + std::to_string(10000 + book(e));
+  unsigned sum = 0;
+  for (unsigned i = 0; i != 9; ++i) {
+    sum += (10 - i) * (digits[i] - '0');
+  }
+  unsigned check = (11 - sum % 11) % 11;
+  return "0-201-" + digits.substr(4) + '-' +
+         (check == 10 ? 'X' : char('0' + check));
+}
+
+// `stores` stores of min_items to max_items sales each, one to five copies
+// of a random book at 9.99, sorted by ISBN as the searches expect
+std::vector<std::vector<Sales_data>>
+random_stores(std::default_random_engine &e, std::size_t stores,
+              std::size_t min_items, std::size_t max_items) {
+  std::uniform_int_distribution<std::size_t> len(min_items, max_items);
+  std::uniform_int_distribution<unsigned> n(1, 5);
+  std::vector<std::vector<Sales_data>> files(stores);
+  for (auto &store : files) {
+    for (std::size_t i = len(e); i != 0; --i) {
+      auto isbn = random_isbn(e);
+      store.emplace_back(isbn, n(e), 9.99);
+    }
+    std::sort(store.begin(), store.end(), compareIsbn);
+  }
+  return files;
+}
+
+// `count` random ISBNs, separated by spaces as reportResults reads them
+std::string random_queries(std::default_random_engine &e, std::size_t count,
+                           unsigned books = 5000) {
+  std::string queries;
+  for (std::size_t i = 0; i != count; ++i) {
+    queries += random_isbn(e, books) + " ";
+  }
+  return queries;
+}
+
+/* -------------------------------------------------------------------------- */
+
+// this function generates the SAME sequence on each call
+std::vector<unsigned> bad_randVec() {
+  std::default_random_engine e;
+  std::uniform_int_distribution<unsigned> u(0, 9);
+
+  std::vector<unsigned> ret;
+  for (size_t i = 0; i != 100; ++i) {
+    ret.push_back(u(e));
+  }
+  return ret;
+}
+
+// static objects preserve their states throughout the program
+// new numbers generated on each call
+std::vector<unsigned> good_randVec() {
+  static std::default_random_engine e;
+  static std::uniform_int_distribution<unsigned> u(0, 9);
+
+  std::vector<unsigned> ret;
+  for (size_t i = 0; i != 100; ++i) {
+    ret.push_back(u(e));
+  }
+  return ret;
+}
+
+/* -------------------------------------------------------------------------- */
+
+int main() {
+  { std::cout << "Hello World!" << std::endl; }
+
+  {
+    // the same book as ISBN-10 and ISBN-13, a bad check digit, too few
+    // digits, and a word
+    Isbn ten("0-201-70353-X"), thirteen("9780201703535"), bad;
+    std::cout << std::boolalpha << (ten == thirteen) << ' ' << ten << ' '
+              << Isbn::parse("0-201-70353-1", bad) << ' '
+              << Isbn::parse("0-201-10042", bad) << ' '
+              << Isbn::parse("C++", bad) << ' ' << sizeof(Isbn)
+              << std::noboolalpha << std::endl;
+  }
+
+  {
+    // 1000 stores, each sorted by ISBN, and the same queries answered by
+    // a search of every store and by the inverted index
+    std::default_random_engine e;
+    auto files = random_stores(e, 1000, 200, 200);
+    auto queries = random_queries(e, 1000);
+
+    std::istringstream in1(queries), in2(queries), in3(queries);
+    std::ostringstream out1, out2, out3;
+    auto t0 = std::chrono::steady_clock::now();
+    reportResults(in1, out1, files);
+    auto t1 = std::chrono::steady_clock::now();
+    isbn_index index(files);
+    auto t2 = std::chrono::steady_clock::now();
+    reportResults(in2, out2, index);
+    auto t3 = std::chrono::steady_clock::now();
+    reportResults_batch(in3, out3, files);
+    auto t4 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> scan_ms = t1 - t0,
+                                              build_ms = t2 - t1,
+                                              index_ms = t3 - t2,
+                                              batch_ms = t4 - t3;
+    std::cout << std::boolalpha
+              << (out1.str() == out2.str() && out1.str() == out3.str())
+              << std::noboolalpha << ": " << scan_ms.count()
+              << " ms searching stores, " << index_ms.count()
+              << " ms with the index (built in " << build_ms.count()
+              << " ms), " << batch_ms.count() << " ms as one batch"
+              << std::endl;
+
+    // the same searches, skipping the stores whose filter rules a book out
+    store_filters filters(files);
+    std::istringstream in5(queries);
+    std::string q;
+    std::size_t absent = 0, passed = 0;
+    bool same_found = true;
+    while (in5 >> q) {
+      auto found = findBook(files, q);
+      same_found = same_found && findBook(filters, files, q) == found;
+      for (std::size_t i = 0; i != files.size(); ++i) {
+        bool in_store = std::any_of(found.cbegin(), found.cend(),
+                                    [&](const matches &m) {
+                                      return std::get<0>(m) == i;
+                                    });
+        absent += !in_store;
+        passed += !in_store && filters.may_contain(i, Isbn(q));
+      }
+    }
+    std::istringstream in6(queries);
+    auto t7 = std::chrono::steady_clock::now();
+    std::size_t hits = 0;
+    while (in6 >> q) {
+      hits += findBook(filters, files, q).size();
+    }
+    auto t8 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> filtered_ms = t8 - t7;
+    std::cout << std::boolalpha << same_found << std::noboolalpha << ": "
+              << hits << " hits in " << filtered_ms.count()
+              << " ms with filters of " << filters.bytes() << " bytes, "
+              << "false positive rate " << double(passed) / absent
+              << " (expected " << filters.false_positive_rate() << ")"
+              << std::endl;
+
+    // the same searches with the stores split across a pool of threads,
+    // each query timed on its own; splitting even the smallest store count
+    // shows where the split starts to pay, which is what pool_min_stores is
+    thread_pool pool(4);
+    std::vector<std::string> isbns;
+    std::istringstream in4(queries);
+    while (in4 >> q) {
+      isbns.push_back(q);
+    }
+    auto median_us = [&](auto search, std::vector<std::vector<matches>> &out) {
+      std::vector<double> us;
+      for (const auto &isbn : isbns) {
+        auto t = std::chrono::steady_clock::now();
+        out.push_back(search(isbn));
+        us.push_back(std::chrono::duration<double, std::micro>(
+                         std::chrono::steady_clock::now() - t)
+                         .count());
+      }
+      std::sort(us.begin(), us.end());
+      return us[us.size() / 2];
+    };
+    bool same = true;
+    std::cout << "findBook median per query, serial / split / pooled:";
+    for (size_t stores : {100, 1000, 10000}) {
+      auto many = stores == files.size() ? files
+                                         : random_stores(e, stores, 200, 200);
+      std::vector<std::vector<matches>> serial_found, split_found,
+          pooled_found;
+      auto serial = median_us(
+          [&](const std::string &isbn) { return findBook(many, isbn); },
+          serial_found);
+      auto split = median_us(
+          [&](const std::string &isbn) {
+            return findBook(pool, many, isbn, 1);
+          },
+          split_found);
+      auto pooled = median_us(
+          [&](const std::string &isbn) { return findBook(pool, many, isbn); },
+          pooled_found);
+      same = same && serial_found == split_found &&
+             serial_found == pooled_found;
+      std::cout << ' ' << stores << " stores " << serial << " / " << split
+                << " / " << pooled << " us;";
+    }
+    std::cout << ' ' << std::boolalpha << same << std::noboolalpha
+              << std::endl;
+  }
+
+  {
+    // all stores as one ISBN-ordered stream, against copying and sorting
+    std::default_random_engine e;
+    auto files = random_stores(e, 1000, 0, 400);
+
+    auto t0 = std::chrono::steady_clock::now();
+    std::vector<std::pair<size_t, const Sales_data *>> merged;
+    for (store_merge m(files); !m.empty(); m.pop()) {
+      merged.emplace_back(m.front().store, m.front().item);
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    std::vector<std::pair<size_t, const Sales_data *>> sorted;
+    for (size_t i = 0; i != files.size(); ++i) {
+      for (const auto &item : files[i]) {
+        sorted.emplace_back(i, &item);
+      }
+    }
+    std::stable_sort(sorted.begin(), sorted.end(),
+                     [](const std::pair<size_t, const Sales_data *> &lhs,
+                        const std::pair<size_t, const Sales_data *> &rhs) {
+                       return compareIsbn(*lhs.second, *rhs.second);
+                     });
+    auto t2 = std::chrono::steady_clock::now();
+
+    // one pass reports every book, just as querying for each book would
+    std::ostringstream all, each;
+    reportAll(all, files);
+    std::string queries;
+    for (auto it = sorted.cbegin(); it != sorted.cend(); ++it) {
+      if (it == sorted.cbegin() ||
+          (it - 1)->second->isbn() != it->second->isbn()) {
+        queries += it->second->isbn().str() + " ";
+      }
+    }
+    std::istringstream in(queries);
+    reportResults(in, each, files);
+    std::chrono::duration<double, std::milli> merge_ms = t1 - t0,
+                                              sort_ms = t2 - t1;
+    std::cout << std::boolalpha
+              << (merged == sorted && all.str() == each.str())
+              << std::noboolalpha << ": " << merged.size()
+              << " records merged in " << merge_ms.count() << " ms, sorted in "
+              << sort_ms.count() << " ms" << std::endl;
+  }
+
+  {
+    // the per-book totals kept up to date while transactions come in
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> n(1, 5), store(0, 99);
+    auto files = random_stores(e, 100, 1000, 1000);
+    sales_totals view(files);
+    std::istringstream in1("0-201-10042-8 0-201-10043-6"),
+        in2("0-201-10042-8 0-201-10043-6");
+    std::ostringstream out1, out2;
+    reportResults(in1, out1, view);
+    reportResults(in2, out2, files);
+
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i != 200000; ++i) {
+      auto isbn = random_isbn(e);
+      view.append(store(e), Sales_data(isbn, n(e), 11.99));
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    auto hot = view.total("0-201-10042-8");
+    auto t2 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::micro> append_us = t1 - t0,
+                                              query_us = t2 - t1;
+    std::cout << std::boolalpha << (out1.str() == out2.str()) << ' '
+              << view.check() << std::noboolalpha << ": "
+              << append_us.count() / 200000 << " us per append, " << hot
+              << " in " << query_us.count() << " us" << std::endl;
+  }
+
+  {
+    // one column scan against a walk over a million Sales_data objects
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> n(1, 5);
+    std::vector<Sales_data> rows;
+    for (size_t i = 0; i != 1000000; ++i) {
+      auto isbn = random_isbn(e, 1000);
+      rows.emplace_back(isbn, n(e), 9.99);
+    }
+    Sales_columns cols(rows.cbegin(), rows.cend());
+
+    auto t0 = std::chrono::steady_clock::now();
+    Sales_data serial("0-201-10042-8");
+    for (const auto &r : rows) {
+      if (r.isbn() == serial.isbn()) {
+        serial += r;
+      }
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    auto columnar = cols.total("0-201-10042-8");
+    auto t2 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> rows_ms = t1 - t0,
+                                              cols_ms = t2 - t1;
+    std::cout << serial << " in " << rows_ms.count() << " ms\n"
+              << columnar << " in " << cols_ms.count() << " ms\n"
+              << "all books: " << cols.total_units() << " units, avg "
+              << cols.avg_price() << std::endl;
+  }
+
+  {
+    std::string text = "0-201-70353-X 4 24.99\n"
+                       "0-201-82470-1 x 45.39\n"
+                       "\n"
+                       "0-201-88954-4 2 15.00 extra\n"
+                       "0-201-88954-4 5 12.00\n";
+    std::vector<Sales_data> items;
+    std::vector<parse_error> errors;
+    parse_sales(text.data(), text.data() + text.size(), items, errors);
+    for (const auto &item : items) {
+      std::cout << item << std::endl;
+    }
+    for (const auto &err : errors) {
+      std::cout << "line " << err.line << ": " << err.reason << std::endl;
+    }
+  }
+
+  {
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> n(1, 5);
+    std::uniform_real_distribution<double> price(5, 50);
+    std::vector<Sales_data> rows;
+    for (size_t i = 0; i != 1000000; ++i) {
+      auto isbn = random_isbn(e, 10000);
+      rows.emplace_back(isbn, n(e), price(e));
+    }
+    auto t0 = std::chrono::steady_clock::now();
+    auto serial = total_by_isbn(rows);
+    auto t1 = std::chrono::steady_clock::now();
+    auto parallel = total_by_isbn(rows, 4);
+    auto t2 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> serial_ms = t1 - t0,
+                                              parallel_ms = t2 - t1;
+    std::cout << serial.size() << " books, " << std::boolalpha
+              << (serial == parallel) << std::noboolalpha << ", "
+              << serial_ms.count() << " ms serial, " << parallel_ms.count()
+              << " ms on 4 threads" << std::endl;
+  }
+
+  {
+    // the ten bestsellers: sorting every total, streaming, and on 4 threads
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> n(1, 5);
+    std::uniform_real_distribution<double> price(5, 50);
+    std::vector<Sales_data> rows;
+    for (size_t i = 0; i != 1000000; ++i) {
+      auto isbn = random_isbn(e, 90000);
+      rows.emplace_back(isbn, n(e), price(e));
+    }
+    std::sort(rows.begin(), rows.end(), compareIsbn);
+
+    auto t0 = std::chrono::steady_clock::now();
+    auto all = total_by_isbn(rows);
+    std::sort(all.begin(), all.end(), by_revenue());
+    all.resize(10);
+    auto t1 = std::chrono::steady_clock::now();
+    auto streamed =
+        top_books<by_revenue>(rows.cbegin(), rows.cend(), 10).sorted();
+    auto t2 = std::chrono::steady_clock::now();
+    auto parallel = top_books<by_revenue>(rows, 10, 4);
+    auto t3 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> sort_ms = t1 - t0,
+                                              stream_ms = t2 - t1,
+                                              parallel_ms = t3 - t2;
+    std::cout << all.front() << '\n'
+              << top_books<by_units>(rows.cbegin(), rows.cend(), 1).sorted()[0]
+              << '\n'
+              << std::boolalpha << (all == streamed && all == parallel)
+              << std::noboolalpha << ": " << sort_ms.count()
+              << " ms sorting all totals, " << stream_ms.count()
+              << " ms streaming, " << parallel_ms.count()
+              << " ms on 4 threads" << std::endl;
+  }
+
+  {
+    // list price most of the time, discounts now and then; two stores'
+    // sketches merged, against the exact quantiles of every copy sold
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> n(1, 5), store(0, 1);
+    std::uniform_real_distribution<double> discount(0.5, 0.95);
+    std::bernoulli_distribution sale(0.2);
+    price_quantiles stores[2];
+    std::vector<double> prices;
+    for (size_t i = 0; i != 200000; ++i) {
+      double p = sale(e) ? std::round(2000 * discount(e)) / 100 : 20.0;
+      unsigned copies = n(e);
+      stores[store(e)].add(Sales_data("0-201-70353-X", copies, p));
+      prices.insert(prices.end(), copies, p);
+    }
+    stores[0].merge(stores[1]);
+    const kll_sketch &sk = *stores[0].find("0-201-70353-X");
+    std::sort(prices.begin(), prices.end());
+    std::cout << sk.count() << " copies, " << sk.retained() << " kept:";
+    for (double q : {0.1, 0.5, 0.95, 0.99}) {
+      auto exact = prices[std::ceil(q * prices.size()) - 1];
+      std::cout << " p" << q * 100 << " " << sk.quantile(q) << " (" << exact
+                << ")";
+    }
+    std::cout << std::endl;
+  }
+
+  {
+    // revenue in doubles and in cents, summed forwards and backwards
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> n(1, 5), price(500, 5000);
+    std::vector<Sales_data> rows;
+    for (size_t i = 0; i != 1000000; ++i) {
+      auto isbn = random_isbn(e, 1000);
+      rows.emplace_back(isbn, n(e), price(e) / 100.0);
+    }
+    Sales_columns fwd(rows.cbegin(), rows.cend()),
+        bwd(rows.crbegin(), rows.crend());
+    Sales_cents cents_fwd(rows.cbegin(), rows.cend()),
+        cents_bwd(rows.crbegin(), rows.crend());
+    std::cout << std::boolalpha << std::setprecision(17)
+              << "double: " << fwd.total_revenue() << " vs "
+              << bwd.total_revenue() << '\n'
+              << "cents: " << format_cents(cents_fwd.total_revenue()) << " vs "
+              << format_cents(cents_bwd.total_revenue()) << ", "
+              << (cents_fwd.total_revenue(1) == cents_fwd.total_revenue(3) &&
+                  cents_fwd.total_revenue(1) == cents_bwd.total_revenue(4))
+              << " across thread counts, avg "
+              << format_cents(cents_fwd.avg_price()) << std::setprecision(6)
+              << std::noboolalpha << std::endl;
+
+    Sales_cents huge;
+    huge.push_back(Isbn("0-201-99999-4"), 1, INT64_MAX);
+    huge.push_back(Isbn("0-201-99999-4"), 1, 1);
+    try {
+      huge.total_revenue();
+    } catch (const std::overflow_error &err) {
+      std::cout << err.what() << std::endl;
+    }
+  }
+
+  {
+    // a sorted history compressed, against the same rows as Sales_data
+    std::default_random_engine e;
+    std::uniform_int_distribution<unsigned> n(1, 5), price(1000, 1200);
+    std::vector<Sales_data> rows;
+    for (size_t i = 0; i != 1000000; ++i) {
+      auto isbn = random_isbn(e, 10000);
+      rows.emplace_back(isbn, n(e), price(e) / 100.0);
+    }
+    std::sort(rows.begin(), rows.end(), compareIsbn);
+    sales_segment seg(rows.cbegin(), rows.cend());
+    Sales_cents exact(rows.cbegin(), rows.cend());
+
+    auto t0 = std::chrono::steady_clock::now();
+    Sales_data sum;
+    for (const auto &r : rows) {
+      sum += r;
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    auto units = seg.total_units();
+    auto revenue = seg.total_revenue();
+    auto t2 = std::chrono::steady_clock::now();
+    auto one = seg.total("0-201-10042-8");
+    auto t3 = std::chrono::steady_clock::now();
+    std::chrono::duration<double, std::milli> rows_ms = t1 - t0,
+                                              seg_ms = t2 - t1,
+                                              one_ms = t3 - t2;
+    auto book_total = exact.total("0-201-10042-8");
+    std::cout << "all rows:" << sum << '\n' // the ISBN of a mixed sum is empty
+              << std::boolalpha
+              << (units == exact.total_units() &&
+                  revenue == exact.total_revenue() &&
+                  one.units == book_total.units &&
+                  one.revenue == book_total.revenue)
+              << std::noboolalpha << ": " << seg.bytes() << " bytes against "
+              << rows.size() * sizeof(Sales_data) << ", scanned in "
+              << seg_ms.count() << " ms against " << rows_ms.count()
+              << " ms, one book in " << one_ms.count() << " ms" << std::endl;
+
+    // three copies for 10.00 in all, which has no whole-cent unit price,
+    // and a refund
+    std::vector<Sales_data> odd{Sales_data("0-201-10042-8", 3, 10.0 / 3),
+                                Sales_data("0-201-10042-8", 1, -4.99)};
+    sales_segment small(odd.cbegin(), odd.cend());
+    std::cout << small.total_units() << " units, "
+              << format_cents(small.total_revenue()) << std::endl;
+  }
+
+  {
+    // the stores written to a binary log once, then queried from the
+    // mapping; the log goes to a scratch directory removed afterwards
+    char dir[] = "/tmp/chpt17.XXXXXX";
+    if (mkdtemp(dir)) {
+      const std::string log_path = std::string(dir) + "/sales.log";
+      try {
+        std::default_random_engine e;
+        auto files = random_stores(e, 1000, 200, 200);
+        auto queries = random_queries(e, 1000);
+        write_sales_log(files, log_path);
+
+        auto t0 = std::chrono::steady_clock::now();
+        sales_log log(log_path);
+        auto t1 = std::chrono::steady_clock::now();
+        std::istringstream in1(queries), in2(queries);
+        std::ostringstream out1, out2;
+        reportResults(in1, out1, log);
+        auto t2 = std::chrono::steady_clock::now();
+        reportResults(in2, out2, files);
+        auto t3 = std::chrono::steady_clock::now();
+        std::chrono::duration<double, std::milli> open_ms = t1 - t0,
+                                                  log_ms = t2 - t1,
+                                                  vec_ms = t3 - t2;
+        std::cout << std::boolalpha << (out1.str() == out2.str())
+                  << std::noboolalpha << ": " << log.records()
+                  << " records opened in " << open_ms.count() << " ms, "
+                  << log_ms.count() << " ms querying the log, "
+                  << vec_ms.count() << " ms querying the vectors"
+                  << std::endl;
+      } catch (const std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+      }
+      unlink(log_path.c_str());
+      rmdir(dir);
+    }
+  }
+
+  {
+    // a transaction file sorted in a fraction of its size in memory; the
+    // file, its runs and the log go to a scratch directory removed afterwards
+    char dir[] = "/tmp/chpt17.XXXXXX";
+    if (mkdtemp(dir)) {
+      const std::string txt_path = std::string(dir) + "/sales.txt";
+      const std::string log_path = std::string(dir) + "/sorted.log";
+      try {
+        std::default_random_engine e;
+        std::uniform_int_distribution<unsigned> n(1, 5);
+        {
+          std::ofstream out(txt_path);
+          for (size_t i = 0; i != 500000; ++i) {
+            auto isbn = random_isbn(e, 50000);
+            out << isbn << ' ' << n(e) << " 9.99\n";
+          }
+        }
+        auto t0 = std::chrono::steady_clock::now();
+        auto errors = sort_sales_file(txt_path, log_path, 1 << 20);
+        auto t1 = std::chrono::steady_clock::now();
+        std::vector<Sales_data> all;
+        parse_sales_file(txt_path, all);
+        std::stable_sort(all.begin(), all.end(), compareIsbn);
+        auto t2 = std::chrono::steady_clock::now();
+
+        sales_log log(log_path);
+        std::vector<std::vector<Sales_data>> files{all};
+        auto queries = random_queries(e, 1000, 50000);
+        std::istringstream in1(queries), in2(queries);
+        std::ostringstream out1, out2;
+        reportResults(in1, out1, log);
+        reportResults(in2, out2, files);
+        std::chrono::duration<double, std::milli> ext_ms = t1 - t0,
+                                                  mem_ms = t2 - t1;
+        std::cout << std::boolalpha
+                  << (errors.empty() && out1.str() == out2.str())
+                  << std::noboolalpha << ": " << log.records()
+                  << " records sorted in 1 MiB in " << ext_ms.count()
+                  << " ms, in memory in " << mem_ms.count() << " ms"
+                  << std::endl;
+      } catch (const std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+      }
+      unlink(txt_path.c_str());
+      unlink(log_path.c_str());
+      rmdir(dir);
+    }
+  }
+
+  {
+    // live transactions logged before they reach the store, then recovered;
+    // the log goes to a scratch directory that is removed afterwards
+    char dir[] = "/tmp/chpt17.XXXXXX";
+    if (mkdtemp(dir)) {
+      const std::string wal_path = std::string(dir) + "/sales.wal";
+      try {
+        std::default_random_engine e;
+        std::uniform_int_distribution<unsigned> n(1, 5), store(0, 99);
+        auto files = random_stores(e, 100, 1000, 1000);
+        const size_t writers = 4, each = 250000;
+        std::vector<std::vector<std::pair<size_t, Sales_data>>> live(writers);
+        for (auto &w : live) {
+          for (size_t i = 0; i != each; ++i) {
+            auto isbn = random_isbn(e);
+            w.emplace_back(store(e), Sales_data(isbn, n(e), 11.99));
+          }
+        }
+
+        sales_totals view(files);
+        std::chrono::duration<double> wal_s;
+        {
+          sales_wal wal(wal_path);
+          auto t0 = std::chrono::steady_clock::now();
+          std::vector<std::thread> threads;
+          for (const auto &w : live) {
+            threads.emplace_back([&wal, &w] {
+              // every record is durable once the wait after it returns
+              for (size_t i = 0; i != w.size(); ++i) {
+                auto ticket = wal.append(w[i].first, w[i].second);
+                if (i % 4096 == 4095 || i + 1 == w.size()) {
+                  wal.wait(ticket);
+                }
+              }
+            });
+          }
+          for (auto &t : threads) {
+            t.join();
+          }
+          wal_s = std::chrono::steady_clock::now() - t0;
+          wal.commit(0, Sales_data("0-201-10042-8", 1, 11.99));
+          for (const auto &w : live) {
+            for (const auto &r : w) {
+              view.append(r.first, r.second);
+            }
+          }
+          view.append(0, Sales_data("0-201-10042-8", 1, 11.99));
+        }
+        // a crash in the middle of a write leaves part of a record behind
+        {
+          std::ofstream torn(wal_path, std::ios::binary | std::ios::app);
+          torn.write("torn", 4);
+        }
+
+        sales_totals rebuilt(files);
+        sales_wal wal(wal_path, [&rebuilt](size_t s, const Sales_data &item) {
+          rebuilt.append(s, item);
+        });
+        std::istringstream in1("0-201-10042-8 0-201-14999-0"),
+            in2("0-201-10042-8 0-201-14999-0");
+        std::ostringstream out1, out2;
+        reportResults(in1, out1, view);
+        reportResults(in2, out2, rebuilt);
+        std::cout << std::boolalpha << (out1.str() == out2.str()) << ' '
+                  << rebuilt.check() << std::noboolalpha << ": "
+                  << wal.replayed() << " records replayed, "
+                  << writers * each / wal_s.count() << " durable appends/s"
+                  << std::endl;
+        try {
+          wal.append(size_t(UINT32_MAX) + 1,
+                     Sales_data("0-201-10042-8", 1, 9.99));
+        } catch (const std::out_of_range &err) {
+          std::cout << err.what() << std::endl;
+        }
+        unlink(wal_path.c_str());
+
+        // and a crash while the header is written leaves part of that
+        {
+          std::ofstream torn(wal_path, std::ios::binary);
+          torn.write("SALES", 5);
+        }
+        sales_wal empty(wal_path);
+        std::cout << empty.replayed() << " records replayed" << std::endl;
+      } catch (const std::runtime_error &err) {
+        std::cerr << err.what() << std::endl;
+      }
+      unlink(wal_path.c_str());
+      rmdir(dir);
+    }
+  }
 
   {
     std::tuple<size_t, size_t, size_t> threeD;